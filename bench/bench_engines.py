@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+# bench_engines.py : time per model of the canonizers, for the thresholds of the auto engine.
+#
+#   bench_engines.py ISONAUT [--inputs DIR] [--table direct|traces|signature|dense|invariant]
+#
+# Runs ISONAUT (a Release build) with --engine X --stats on inputs made by gen_inputs.py and
+# prints the tables of the README: direct against nauty (CanonWorkspace::Direct_max_order),
+# traces against nauty (Traces_min_order) by order and by signature at the same orders, and
+# dense against nauty.  The time of a model is
+# that of the graph, nauty and key phases of --stats, so parsing and lookups are left out.
+# The invariant table gives the nauty search-tree nodes on the Latin squares of order 5 with
+# the vertex invariants and --refine, which depend on the input order but not on the machine.
+# The inputs are written to DIR (default: a temporary directory) and reused if already there.
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# per table: the engines compared, and the rows as title, gen_inputs.py arguments
+TABLES = {
+    "direct": (["nauty", "direct"], [
+        ("Latin squares, order 5", ["latin", "5"]),
+        ("cyclic group, order 6", ["cyclic", "6"]),
+        ("random magmas, order 7", ["magma", "7", "-c", "3000"]),
+        ("Steiner quasigroup, order 7", ["steiner", "7"]),
+        ("Z2^3, order 8", ["z2", "8", "-c", "200"]),
+    ]),
+    "traces": (["nauty", "traces"], [
+        ("Latin squares, order 5", ["latin", "5"]),
+        ("cyclic group, order 10", ["cyclic", "10"]),
+        ("cyclic group, order 12", ["cyclic", "12"]),
+        ("random magmas, order 16", ["magma", "16", "-c", "400"]),
+        ("cyclic group, order 24", ["cyclic", "24", "-c", "40"]),
+        ("unary operations, order 300", ["unary", "300", "-c", "400"]),
+    ]),
+    "signature": (["nauty", "traces"], [
+        ("cyclic group, order 8", ["cyclic", "8", "-c", "300"]),
+        ("cyclic group and inverse, order 8", ["cyclic", "8", "-c", "300", "--inverse"]),
+        ("ring Z_8", ["ring", "8", "-c", "300"]),
+        ("random ternary operations, order 8", ["ternary", "8", "-c", "200"]),
+        ("cyclic group, order 12", ["cyclic", "12", "-c", "300"]),
+        ("cyclic group and inverse, order 12", ["cyclic", "12", "-c", "300", "--inverse"]),
+        ("ring Z_12", ["ring", "12", "-c", "300"]),
+        ("random ternary operations, order 12", ["ternary", "12", "-c", "200"]),
+        ("cyclic group, order 16", ["cyclic", "16", "-c", "300"]),
+        ("cyclic group and inverse, order 16", ["cyclic", "16", "-c", "300", "--inverse"]),
+        ("ring Z_16", ["ring", "16", "-c", "300"]),
+    ]),
+    "dense": (["nauty", "dense"], [
+        ("two unary operations, order 3", ["unary", "3", "-c", "2000", "--ops", "2"]),
+        ("semigroups, order 3", ["semigroup", "3"]),
+        ("Latin squares, order 5", ["latin", "5"]),
+        ("random magmas, order 8", ["magma", "8", "-c", "3000"]),
+        ("random magmas, order 10", ["magma", "10", "-c", "3000"]),
+    ]),
+}
+
+# options of the invariant table, all with --engine nauty
+INVARIANT_INPUT = ["latin", "5"]
+INVARIANT_OPTIONS = [
+    [],
+    ["--invariant", "distances"],
+    ["--refine"],
+    ["--invariant", "isonaut", "--maxinvarlevel", "1"],
+    ["--refine", "--invariant", "isonaut", "--maxinvarlevel", "1"],
+]
+
+CANON_PHASES = ("graph", "nauty", "key")
+
+
+def input_file(inputs, gen_args):
+    path = os.path.join(inputs, "_".join(a.lstrip("-") for a in gen_args) + ".txt")
+    if not os.path.exists(path):
+        with open(path + ".tmp", "w") as f:
+            subprocess.check_call([sys.executable, os.path.join(HERE, "gen_inputs.py")] + gen_args, stdout=f)
+        os.rename(path + ".tmp", path)
+    return path
+
+
+def time_per_model(isonaut, engine, path, inputs):
+    # no repeat cache: the relabelled copies repeat, and a repeat is not canonicalized
+    stats = os.path.join(inputs, "stats.json")
+    with open(os.devnull, "w") as null:
+        subprocess.check_call([isonaut, "--engine", engine, "--repeat-cache", "0", "--stats", stats, path],
+                              stdout=null, stderr=null)
+    with open(stats) as f:
+        s = json.load(f)
+    seconds = sum(s["phases"][p]["seconds"] for p in CANON_PHASES)
+    return seconds / s["models"] * 1e6
+
+
+def search_nodes(isonaut, options, path):
+    out = subprocess.check_output([isonaut, "--engine", "nauty"] + options + [path], stderr=subprocess.STDOUT)
+    for line in out.decode().splitlines():
+        if line.startswith("% Nauty search-tree nodes:"):
+            return int(line.split(":")[1])
+    sys.exit("%s: no search-tree nodes in the summary" % isonaut)
+
+
+def print_invariant_table(isonaut, inputs):
+    path = input_file(inputs, INVARIANT_INPUT)
+    print("| options | search-tree nodes |")
+    print("|---|---|")
+    for options in INVARIANT_OPTIONS:
+        print("| %s | %d |" % ("`%s`" % " ".join(options) if options else "(default)", search_nodes(isonaut, options, path)))
+        sys.stdout.flush()
+    print()
+
+
+def main():
+    ap = argparse.ArgumentParser(description="time per model of the isonaut canonizers")
+    ap.add_argument("isonaut", help="the isonaut binary, preferably a Release build")
+    ap.add_argument("--inputs", help="directory for the generated inputs (kept)")
+    ap.add_argument("--table", choices=sorted(TABLES) + ["invariant"], action="append", help="only these tables")
+    args = ap.parse_args()
+    inputs = args.inputs or tempfile.mkdtemp(prefix="isonaut_bench_")
+    if not os.path.isdir(inputs):
+        os.makedirs(inputs)
+
+    for name in args.table or ["direct", "traces", "signature", "dense", "invariant"]:
+        if name == "invariant":
+            print_invariant_table(args.isonaut, inputs)
+            continue
+        engines, rows = TABLES[name]
+        print("| input | %s |" % " | ".join(engines))
+        print("|---|%s" % ("---|" * len(engines)))
+        for title, gen_args in rows:
+            path = input_file(inputs, gen_args)
+            times = [time_per_model(args.isonaut, e, path, inputs) for e in engines]
+            print("| %s | %s |" % (title, " | ".join("%.3g us" % t for t in times)))
+            sys.stdout.flush()
+        print()
+    if not args.inputs:
+        sys.stderr.write("inputs left in %s\n" % inputs)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+# gen_inputs.py : Mace4-style inputs for the engine benchmarks, see bench_engines.py.
+#
+#   gen_inputs.py latin N                  all the Latin squares of order N (N <= 5)
+#   gen_inputs.py semigroup N              all the semigroups of order N (N <= 3)
+#   gen_inputs.py cyclic N [-c COUNT] [--inverse]
+#                                          relabelled copies of the cyclic group of order N,
+#                                          with --inverse also its inverse as a unary operation
+#   gen_inputs.py ring N [-c COUNT]        relabelled copies of the ring Z_N (+ and *)
+#   gen_inputs.py z2 N [-c COUNT]          relabelled copies of Z2^k, N = 2^k
+#   gen_inputs.py steiner 7 [-c COUNT]     relabelled copies of the Steiner quasigroup of order 7
+#   gen_inputs.py magma N [-c COUNT]       relabelled copies of COUNT/10 random magmas
+#   gen_inputs.py unary N [-c COUNT] [--ops K] [--constants C]
+#                                          relabelled copies of COUNT/4 random unary algebras
+#   gen_inputs.py poset N [-c COUNT]       relabelled copies of COUNT/4 random posets
+#   gen_inputs.py ternary N [-c COUNT]     relabelled copies of COUNT/10 random ternary operations
+#
+# The models are written to stdout.  The random ones depend only on the arguments and --seed.
+
+import argparse
+import itertools
+import random
+import sys
+
+
+def table_text(kind, name, arity, n, t):
+    if arity == 0:
+        return "  function(%s, [%d])" % (name, t[0])
+    if arity == 1:
+        return "  %s(%s(_), [%s ])" % (kind, name, ",".join(map(str, t)))
+    args = ",".join("_" * arity)
+    rows = ["    " + ",".join(map(str, t[r * n:(r + 1) * n])) for r in range(len(t) // n)]
+    return "  %s(%s(%s), [\n%s ])" % (kind, name, args, ",\n".join(rows))
+
+
+def model_text(n, number, tables):
+    items = [table_text(kind, name, arity, n, t) for kind, name, arity, t in tables]
+    return "interpretation( %d, [number=%d, seconds=0], [\n%s]).\n\n" % (n, number, ",\n".join(items))
+
+
+def relabel(n, tables, p):
+    """The model with element a renamed p[a]."""
+    q = [0] * n
+    for a in range(n):
+        q[p[a]] = a
+    out = []
+    for kind, name, arity, t in tables:
+        if arity == 0:
+            u = [p[t[0]]]
+        elif arity == 1:
+            u = [p[t[q[x]]] for x in range(n)]
+        else:
+            u = [t[sum(q[a] * n ** (arity - 1 - i) for i, a in enumerate(cell))]
+                 for cell in itertools.product(range(n), repeat=arity)]
+            if kind == "function":
+                u = [p[v] for v in u]
+        out.append((kind, name, arity, u))
+    return out
+
+
+def latin_squares(n):
+    t = [-1] * (n * n)
+
+    def fill(cell):
+        if cell == n * n:
+            yield list(t)
+            return
+        r, c = divmod(cell, n)
+        used = set(t[r * n:r * n + c]) | set(t[x * n + c] for x in range(r))
+        for v in range(n):
+            if v not in used:
+                t[cell] = v
+                for s in fill(cell + 1):
+                    yield s
+        t[cell] = -1
+
+    return fill(0)
+
+
+def semigroups(n):
+    for i in range(n ** (n * n)):
+        t = [(i // n ** k) % n for k in range(n * n)]
+        if all(t[t[a * n + b] * n + c] == t[a * n + t[b * n + c]]
+               for a in range(n) for b in range(n) for c in range(n)):
+            yield t
+
+
+def random_poset(n, rnd):
+    # a random dag on a random order of the elements, closed under transitivity, reflexive
+    order = list(range(n))
+    rnd.shuffle(order)
+    le = [[int(a == b) for b in range(n)] for a in range(n)]
+    for i in range(n):
+        for j in range(i + 1, n):
+            if rnd.random() < 0.3:
+                le[order[i]][order[j]] = 1
+    for k in range(n):
+        for a in range(n):
+            if le[a][k]:
+                for b in range(n):
+                    if le[k][b]:
+                        le[a][b] = 1
+    return [le[a][b] for a in range(n) for b in range(n)]
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Mace4-style inputs for the engine benchmarks")
+    ap.add_argument("kind", choices=["latin", "semigroup", "cyclic", "ring", "z2", "steiner", "magma", "unary", "poset",
+                                     "ternary"])
+    ap.add_argument("order", type=int)
+    ap.add_argument("-c", "--count", type=int, default=2000, help="number of models of the relabelled kinds")
+    ap.add_argument("--ops", type=int, default=1, help="unary operations, for unary")
+    ap.add_argument("--constants", type=int, default=0, help="constants, for unary")
+    ap.add_argument("--inverse", action="store_true", help="the inverse as a unary operation, for cyclic")
+    ap.add_argument("--seed", type=int, default=1)
+    args = ap.parse_args()
+    n = args.order
+    rnd = random.Random(args.seed)
+    out = sys.stdout
+
+    if args.kind in ("latin", "semigroup"):
+        tables = latin_squares(n) if args.kind == "latin" else semigroups(n)
+        for number, t in enumerate(tables, 1):
+            out.write(model_text(n, number, [("function", "*", 2, t)]))
+        return
+
+    if args.kind == "cyclic":
+        bases = [[("function", "*", 2, [(a + b) % n for a in range(n) for b in range(n)])]]
+        if args.inverse:
+            bases[0].append(("function", "'", 1, [(n - a) % n for a in range(n)]))
+    elif args.kind == "ring":
+        bases = [[("function", "+", 2, [(a + b) % n for a in range(n) for b in range(n)]),
+                  ("function", "*", 2, [(a * b) % n for a in range(n) for b in range(n)])]]
+    elif args.kind == "z2":
+        if n & (n - 1):
+            sys.exit("z2: the order must be a power of 2")
+        bases = [[("function", "*", 2, [a ^ b for a in range(n) for b in range(n)])]]
+    elif args.kind == "steiner":
+        if n != 7:
+            sys.exit("steiner: only order 7 (the Fano plane)")
+        lines = [(0, 1, 3), (1, 2, 4), (2, 3, 5), (3, 4, 6), (4, 5, 0), (5, 6, 1), (6, 0, 2)]
+        third = {}
+        for line in lines:
+            for a in line:
+                for b in line:
+                    if a != b:
+                        third[(a, b)] = sum(line) - a - b
+        bases = [[("function", "*", 2, [a if a == b else third[(a, b)] for a in range(n) for b in range(n)])]]
+    elif args.kind == "magma":
+        bases = [[("function", "*", 2, [rnd.randrange(n) for _ in range(n * n)])]
+                 for _ in range(max(1, args.count // 10))]
+    elif args.kind == "ternary":
+        bases = [[("function", "m", 3, [rnd.randrange(n) for _ in range(n ** 3)])]
+                 for _ in range(max(1, args.count // 10))]
+    elif args.kind == "unary":
+        bases = [[("function", "c%d" % i, 0, [rnd.randrange(n)]) for i in range(args.constants)] +
+                 [("function", "f%d" % i, 1, [rnd.randrange(n) for _ in range(n)]) for i in range(args.ops)]
+                 for _ in range(max(1, args.count // 4))]
+    else:
+        bases = [[("relation", "<", 2, random_poset(n, rnd))] for _ in range(max(1, args.count // 4))]
+
+    for number in range(1, args.count + 1):
+        p = list(range(n))
+        rnd.shuffle(p)
+        out.write(model_text(n, number, relabel(n, rnd.choice(bases), p)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,152 @@
+/* canon_key.h : packed binary canonical keys of models. */
+/* Version 1.1, July 2023. */
+
+#ifndef CANON_KEY_H
+#define CANON_KEY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/*  The canonical form of a model as a bit string: a header word describing the model
+    (order, number of tables of each kind, ...) followed by the relabelled cells, each
+    packed in a fixed number of bits into 64-bit words.
+    The hash is computed once by finish(); equality compares the words with memcmp.
+ */
+class CanonKey {
+private:
+    std::vector<uint64_t> words;
+    size_t                num_bits;
+    uint64_t              hash_val;
+
+public:
+    CanonKey() : num_bits(0), hash_val(0) {};
+
+    // number of bits needed to store the codes 0 .. num_codes-1
+    static unsigned bits_for(size_t num_codes) {
+        unsigned bits = 1;
+        while (bits < 64 && (uint64_t(1) << bits) < num_codes)
+            ++bits;
+        return bits;
+    };
+
+    // starts a new key, keeping the allocated words
+    void reset(uint64_t header) {
+        words.clear();
+        words.push_back(header);
+        num_bits = 64;
+        hash_val = 0;
+    };
+
+    // appends the lowest "width" bits of code
+    void push(uint64_t code, unsigned width) {
+        const unsigned offset = num_bits & 63;
+        if (offset == 0)
+            words.push_back(code);
+        else {
+            words.back() |= code << offset;
+            if (offset + width > 64)
+                words.push_back(code >> (64 - offset));
+        }
+        num_bits += width;
+    };
+
+    void finish() { hash_val = hash_words(words.data(), words.size()); };
+
+    static uint64_t hash_words(const uint64_t* w, size_t n) {
+        uint64_t h = 0x9E3779B97F4A7C15ULL ^ n;
+        for (size_t idx = 0; idx < n; ++idx) {
+            h ^= w[idx];
+            h *= 0xFF51AFD7ED558CCDULL;
+            h ^= h >> 33;
+        }
+        // final avalanche, so the low bits (table index) depend on all the words
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 29;
+        return h;
+    };
+
+    // 128-bit hash of the key (MurmurHash3 x64_128 over the words), for fingerprint-only dedup
+    void fingerprint(uint64_t& lo, uint64_t& hi) const { fingerprint_words(words.data(), words.size(), lo, hi); };
+    static void fingerprint_words(const uint64_t* w, size_t n, uint64_t& lo, uint64_t& hi);
+
+    uint64_t        hash() const { return hash_val; };
+    size_t          size() const { return words.size(); };     // in words
+    const uint64_t* data() const { return words.data(); };
+
+    bool operator==(const CanonKey& a) const {
+        return words.size() == a.words.size() &&
+               memcmp(words.data(), a.words.data(), words.size() * sizeof(uint64_t)) == 0;
+    };
+
+    // a total order on the keys, shorter first, then by the words
+    bool operator<(const CanonKey& a) const {
+        if (words.size() != a.words.size())
+            return words.size() < a.words.size();
+        return std::lexicographical_compare(words.begin(), words.end(), a.words.begin(), a.words.end());
+    };
+
+    std::string to_string() const;   // hex digits, for printing
+};
+
+struct CanonKeyHash {
+    size_t operator()(const CanonKey& key) const { return key.hash(); };
+};
+
+inline std::string
+CanonKey::to_string() const
+{
+    static const char hex[] = "0123456789abcdef";
+    std::string str;
+    for (auto w : words) {
+        for (int shift = 60; shift >= 0; shift -= 4)
+            str.push_back(hex[(w >> shift) & 0x0F]);
+    }
+    return str;
+}
+
+inline void
+CanonKey::fingerprint_words(const uint64_t* w, size_t n, uint64_t& lo, uint64_t& hi)
+{
+    const uint64_t c1 = 0x87C37B91114253D5ULL;
+    const uint64_t c2 = 0x4CF5AD432745937FULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto fmix = [](uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xFF51AFD7ED558CCDULL;
+        k ^= k >> 33;
+        k *= 0xC4CEB9FE1A85EC53ULL;
+        k ^= k >> 33;
+        return k;
+    };
+    uint64_t h1 = 0x5BD1E9955BD1E995ULL;
+    uint64_t h2 = 0x5BD1E9955BD1E995ULL;
+    size_t idx = 0;
+    for (; idx + 1 < n; idx += 2) {
+        uint64_t k1 = w[idx];
+        uint64_t k2 = w[idx+1];
+        k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52DCE729;
+        k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495AB5;
+    }
+    if (idx < n) {
+        uint64_t k1 = w[idx];
+        k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+    h1 ^= n * sizeof(uint64_t);
+    h2 ^= n * sizeof(uint64_t);
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix(h1);
+    h2 = fmix(h2);
+    h1 += h2;
+    h2 += h1;
+    lo = h1;
+    hi = h2;
+}
+
+#endif
@@ -0,0 +1,266 @@
+/* canon_workspace.cpp
+ */
+#include <mutex>
+#include <utility>
+#include "canon_workspace.h"
+
+// Traces, which nauty.a also holds.  Its header comes with the nauty sources; CMake defines
+// HAVE_TRACES_H when it finds it in NAUTY_INCLUDE_DIR.  Without it, the declarations below
+// are those of traces.h in nauty 2.8.8, the version of the nauty.h shipped here, and any
+// other nauty.h stops the build rather than let them go out of date.
+#ifdef HAVE_TRACES_H
+#include "traces.h"
+extern "C" {
+#else
+#if NAUTYVERSIONID != 28080+HAVE_TLS
+#error "traces.h not found: configure with -DNAUTY_INCLUDE_DIR=<nauty source directory>"
+#endif
+extern "C" {
+typedef struct permnodestruct permnode;
+
+typedef struct TracesOptions {
+    boolean getcanon;
+    boolean writeautoms;
+    boolean cartesian;
+    boolean digraph;
+    boolean defaultptn;
+    int linelength;
+    FILE* outfile;
+    int strategy;
+    int verbosity;
+    permnode **generators;
+    void (*userautomproc)(int,int*,int);
+    int (*usercanonproc)(graph*,int*,graph*,int,int);
+    boolean weighted;
+} TracesOptions;
+
+#define DEFAULTOPTIONS_TRACES(opts) TracesOptions opts \
+    = { FALSE, FALSE, FALSE, FALSE, TRUE, 0, NULL, 0, 0, NULL, NULL, NULL, FALSE }
+
+typedef struct TracesStats {
+    double grpsize1;
+    int grpsize2;
+    int numgenerators;
+    int numorbits;
+    int treedepth;
+    int canupdates;
+    int errstatus;
+    unsigned long numnodes;
+    unsigned long interrupted;
+    unsigned long peaknodes;
+} TracesStats;
+
+void Traces(sparsegraph*,int*,int*,int*,TracesOptions*,TracesStats*,sparsegraph*);
+#endif
+
+// dense-graph invariants, from nautinv.h
+void adjacencies(graph*,int*,int*,int,int,int,int*,int,boolean,int,int);
+void distances(graph*,int*,int*,int,int,int,int*,int,boolean,int,int);
+}
+
+#if !HAVE_TLS
+// nauty.a built without thread-local storage keeps its own work areas in static
+// storage, so calls into it from different threads must take turns.
+// Link a nauty built with USE_TLS (e.g. nautyT.a) to lift this restriction.
+static std::mutex nauty_mutex;
+#endif
+
+// the workspace being canonicalized on this thread, for isonaut_invariant
+static thread_local const CanonWorkspace* current_ws = nullptr;
+
+static void
+isonaut_invariant(graph*, int*, int*, int, int, int, int* invar, int, boolean, int, int n)
+{
+    // a function of the model only (see Model::vertex_invariants), so of the graph
+    const std::vector<int>& inv = current_ws->vertex_inv;
+    for (int v = 0; v < n; ++v)
+        invar[v] = inv[v];
+}
+
+CanonWorkspace::CanonWorkspace()
+    : lab(NULL), lab_sz(0), ptn(NULL), ptn_sz(0), orbits(NULL), orbits_sz(0), refine_cells(false),
+      anti_iso(false), total_nodes(0), collect_stats(false), invariant(Adjacencies_invariant), engine(Auto_engine)
+{
+    DEFAULTOPTIONS_SPARSEDIGRAPH(default_options);
+    options = default_options;
+    options.getcanon = TRUE;
+    options.defaultptn = FALSE;
+    DEFAULTOPTIONS_DIGRAPH(default_dense_options);
+    dense_options = default_dense_options;
+    dense_options.getcanon = TRUE;
+    dense_options.defaultptn = FALSE;
+
+    SG_INIT(sg);
+    SG_INIT(cg);
+    SG_INIT(spare_sg);
+}
+
+CanonWorkspace::~CanonWorkspace()
+{
+    SG_FREE(sg);
+    SG_FREE(cg);
+    SG_FREE(spare_sg);
+    DYNFREE(lab, lab_sz);
+    DYNFREE(ptn, ptn_sz);
+    DYNFREE(orbits, orbits_sz);
+}
+
+void
+CanonWorkspace::reserve(size_t num_vertices, size_t num_edges)
+{
+    /* Makes room for a graph of the given size and sets sg.nv and sg.nde.
+       Arrays only grow, so the space is reused by the next, smaller or equal, graph.
+     */
+    int mx = SETWORDSNEEDED(num_vertices);
+    nauty_check(WORDSIZE,mx,num_vertices,NAUTYVERSIONID);
+
+    DYNALLOC1(int,lab,lab_sz,num_vertices,"malloc");
+    DYNALLOC1(int,ptn,ptn_sz,num_vertices,"malloc");
+    DYNALLOC1(int,orbits,orbits_sz,num_vertices,"malloc");
+
+    SG_ALLOC(sg,num_vertices,num_edges,"malloc");
+    sg.nv = num_vertices;     // Number of vertices
+    sg.nde = num_edges;       // Number of directed edges
+}
+
+void
+CanonWorkspace::swap_templates()
+{
+    // the graph arrays are swapped, not copied; lab, ptn and orbits are only grown, so they
+    // are large enough for either graph
+    std::swap(sg, spare_sg);
+    template_sig.swap(spare_sig);
+    template_lab.swap(spare_lab);
+    template_ptn.swap(spare_ptn);
+}
+
+void
+CanonWorkspace::canonicalize(Engine how)
+{
+    /* Canonical labelling of sg with the colouring in lab/ptn, by sparsenauty, densenauty
+       or Traces (how is one of Nauty_engine, Dense_engine and Traces_engine).
+       On return lab holds the canonical labelling, cg the canonical graph with sorted lists.
+     */
+    uint64_t search_cycles = 0;
+    {
+#if !HAVE_TLS
+        std::lock_guard<std::mutex> lock(nauty_mutex);
+#endif
+        if (how == Dense_engine) {
+            // the same graph as a packed adjacency matrix, for densenauty
+            const int m = SETWORDSNEEDED(sg.nv);
+            dense_g.assign(size_t(m) * sg.nv, 0);
+            dense_cg.resize(size_t(m) * sg.nv);
+            for (int v = 0; v < sg.nv; ++v) {
+                for (size_t idx = sg.v[v]; idx < sg.v[v] + sg.d[v]; ++idx)
+                    ADDONEARC(dense_g.data(), v, sg.e[idx], m);
+            }
+            current_ws = this;
+            search_cycles = RunStats::cycles();
+            densenauty(dense_g.data(),lab,ptn,orbits,&dense_options,&stats,m,sg.nv,dense_cg.data());
+        }
+        else if (how == Traces_engine) {
+            // the graphs of the models are symmetric, so Traces takes them as undirected
+            DEFAULTOPTIONS_TRACES(traces_options);
+            traces_options.getcanon = TRUE;
+            traces_options.defaultptn = FALSE;
+            TracesStats   traces_stats;
+            search_cycles = RunStats::cycles();
+            Traces(&sg,lab,ptn,orbits,&traces_options,&traces_stats,&cg);
+            stats.numnodes = traces_stats.numnodes;
+            stats.numbadleaves = 0;
+            stats.maxlevel = traces_stats.treedepth;
+            stats.grpsize1 = traces_stats.grpsize1;
+            stats.grpsize2 = traces_stats.grpsize2;
+        }
+        else {
+            current_ws = this;
+            search_cycles = RunStats::cycles();
+            sparsenauty(&sg,lab,ptn,orbits,&options,&stats,&cg);
+        }
+        search_cycles = RunStats::cycles() - search_cycles;
+    }
+    if (collect_stats) {
+        run_stats.add_search(search_cycles, stats);
+        model_search.add(search_cycles, stats);
+    }
+    total_nodes += stats.numnodes;
+    if (how == Dense_engine)   // cg from the dense canonical graph
+        nauty_to_sg(dense_cg.data(), &cg, SETWORDSNEEDED(sg.nv), sg.nv);
+    sortlists_sg(&cg);
+}
+
+bool
+CanonWorkspace::set_invariant(const std::string& name, int arg, int min_level, int max_level)
+{
+    /* Selects the vertex invariant by name: "adjacencies", "distances" (nauty's invariants
+       that exist for both sparse and dense graphs; the dense-only ones such as adjtriang or
+       cellquads cannot be used with sparsenauty), "isonaut" or "none", with its invararg
+       and levels.
+       Returns false for an unknown name.
+     */
+    if (name == "adjacencies") {
+        invariant = Adjacencies_invariant;
+        options.invarproc = adjacencies_sg;
+        dense_options.invarproc = adjacencies;
+    }
+    else if (name == "distances") {
+        invariant = Distances_invariant;
+        options.invarproc = distances_sg;
+        dense_options.invarproc = distances;
+    }
+    else if (name == "isonaut") {
+        invariant = Isonaut_invariant;
+        options.invarproc = dense_options.invarproc = isonaut_invariant;
+    }
+    else if (name == "none") {
+        invariant = No_invariant;
+        options.invarproc = dense_options.invarproc = NULL;
+    }
+    else
+        return false;
+    options.invararg = dense_options.invararg = arg;
+    options.mininvarlevel = dense_options.mininvarlevel = min_level;
+    options.maxinvarlevel = dense_options.maxinvarlevel = max_level;
+    return true;
+}
+
+bool
+CanonWorkspace::set_engine(const std::string& name)
+{
+    /* Selects the canonizer by name: "auto", "nauty", "dense", "traces" or "direct".
+       Returns false for an unknown name.
+     */
+    if (name == "auto")
+        engine = Auto_engine;
+    else if (name == "nauty")
+        engine = Nauty_engine;
+    else if (name == "dense")
+        engine = Dense_engine;
+    else if (name == "traces")
+        engine = Traces_engine;
+    else if (name == "direct")
+        engine = Direct_engine;
+    else
+        return false;
+    return true;
+}
+
+uint64_t
+CanonWorkspace::key_form() const
+{
+    /* A hash (FNV-1a) of everything in the workspace that changes the canonical keys: the
+       engine and the auto thresholds, the vertex invariant and its levels, refine_cells and
+       anti_iso.  Keys are only comparable between runs with the same key_form.  -c (save_cg)
+       is left out: Model::canonize labels a model the same way with and without it.
+     */
+    const int64_t fields[] = {engine, Direct_max_order, Traces_min_order,
+                              invariant, options.invararg, options.mininvarlevel, options.maxinvarlevel,
+                              refine_cells, anti_iso};
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (auto field : fields) {
+        for (int byte = 0; byte < 8; ++byte)
+            h = (h ^ ((uint64_t(field) >> (8 * byte)) & 0xFF)) * 0x100000001B3ULL;
+    }
+    return h;
+}
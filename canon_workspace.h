@@ -0,0 +1,103 @@
+/* canon_workspace.h : caller-owned work areas for canonicalizing models. */
+/* Version 1.1, July 2023. */
+
+#ifndef CANON_WORKSPACE_H
+#define CANON_WORKSPACE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "nausparse.h"    /* which includes nauty.h */
+#include "run_stats.h"
+
+/*  Everything Model::build_graph needs to hand a graph to sparsenauty: the graph itself,
+    the canonical graph, the colour partition and the nauty options and statistics.
+    The arrays are grown on demand and kept between calls, so one workspace per thread
+    can canonicalize any number of models without allocating.  Each thread must use its
+    own workspace.
+ */
+class CanonWorkspace {
+public:
+    sparsegraph sg;         // graph of the model being canonicalized
+    sparsegraph cg;         // its canonical form, filled by canonicalize()
+    int*        lab;
+    size_t      lab_sz;
+    int*        ptn;
+    size_t      ptn_sz;
+    int*        orbits;
+    size_t      orbits_sz;
+    optionblk   options;
+    optionblk   dense_options;   // the same for densenauty
+    statsblk    stats;
+    bool        refine_cells;   // split the element cells by invariants (Model::refine_cells)
+    bool        anti_iso;       // keep the smaller key of the model and its transpose (Model::build_graph)
+    double      total_nodes;    // stats.numnodes summed over the canonicalize() calls
+    bool        collect_stats;  // time the nauty calls and keep their stats in run_stats
+    RunStats    run_stats;      // --stats counters of the thread using this workspace
+    SearchCost  model_search;   // the nauty calls since it was last cleared, with collect_stats
+
+    // Vertex invariant given to nauty (options.invarproc).  The sparse digraph default is
+    // adjacencies_sg; the isonaut invariant reads vertex_inv, which the graph builder fills.
+    enum Invariant { Adjacencies_invariant, Distances_invariant, Isonaut_invariant, No_invariant };
+    Invariant           invariant;
+    std::vector<int>    vertex_inv;
+
+    // Canonizer: sparsenauty, densenauty on the graph as an adjacency matrix, Traces, or
+    // Model::canonize_direct, which searches the relabellings of the tables without building
+    // a graph.  Auto takes the direct search up to Direct_max_order, then sparsenauty, then
+    // Traces from Traces_min_order.  Densenauty is only taken when asked for: on the graphs
+    // built here (most vertices of degree 3 or 4) it was slower than sparsenauty at every
+    // size measured, even with m = 1.
+    // Auto also labels unary-only models without a graph when it can (Model::canonize_unary),
+    // and gives relation-only models a graph of one layer per relation (build_relation_graph).
+    enum Engine { Auto_engine, Nauty_engine, Dense_engine, Traces_engine, Direct_engine };
+    static const size_t Direct_max_order = 6;
+    static const size_t Traces_min_order = 12;
+    Engine              engine;
+    std::vector<setword> dense_g;    // the graph and canonical graph for densenauty
+    std::vector<setword> dense_cg;
+
+    // Graph template: the graph builder records in template_sig the layout and signature
+    // (order, number of ops of each arity, ...) of the model whose graph is in sg, and the
+    // colouring of its vertices.  A model with the same signature only needs to patch the
+    // value-dependent edges of sg.  Anything else writing to sg must clear template_sig.
+    // The template used before it is kept in spare_sg, so two signatures that alternate,
+    // such as the two orientations of each model with anti_iso, both keep theirs.
+    static const size_t Sparse_layout = 1;
+    std::vector<size_t> template_sig;
+    std::vector<int>    template_lab;
+    std::vector<int>    template_ptn;
+    sparsegraph         spare_sg;
+    std::vector<size_t> spare_sig;
+    std::vector<int>    spare_lab;
+    std::vector<int>    spare_ptn;
+
+public:
+    CanonWorkspace();
+    ~CanonWorkspace();
+    CanonWorkspace(const CanonWorkspace&) = delete;
+    CanonWorkspace& operator=(const CanonWorkspace&) = delete;
+
+    void reserve(size_t num_vertices, size_t num_edges);
+    void swap_templates();
+    void canonicalize(Engine how = Nauty_engine);
+    bool set_invariant(const std::string& name, int arg, int min_level, int max_level);
+    bool set_engine(const std::string& name);
+    uint64_t key_form() const;     // identifies the options the canonical keys depend on
+    bool use_direct(size_t order) const {
+        return engine == Direct_engine || (engine == Auto_engine && order <= Direct_max_order);
+    };
+    // the engine for the graph of a model of that order, if not direct; the signature is left
+    // out, since at a given order it did not change which engine was faster (bench_engines.py)
+    Engine graph_engine(size_t order) const {
+        if (engine != Auto_engine)
+            return engine;
+        return order >= Traces_min_order? Traces_engine : Nauty_engine;
+    };
+
+    static bool is_thread_safe() { return HAVE_TLS; };
+};
+
+#endif
@@ -0,0 +1,241 @@
+/* external_dedup.cpp
+ */
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <unistd.h>
+#include "external_dedup.h"
+
+bool
+ExternalDedup::open(const std::string& spill_dir, size_t budget_bytes)
+{
+    /* Returns true if success, false otherwise (with a message on std::cerr). */
+    dir = spill_dir;
+    budget = budget_bytes;
+    offsets_name = dir + "/isonaut_offsets_" + std::to_string(getpid()) + ".bin";
+    offsets.open(offsets_name.c_str(), std::ios::binary | std::ios::trunc);
+    if (!offsets) {
+        std::cerr << "ExternalDedup: cannot create " << offsets_name << std::endl;
+        offsets_name.clear();
+        return false;
+    }
+    return true;
+}
+
+bool
+ExternalDedup::add(const CanonKey& key, uint64_t offset, uint64_t len)
+{
+    /* Returns false if a write failed, now or earlier (with a message on std::cerr). */
+    if (failed)
+        return false;
+    uint64_t off_len[2] = {offset, len};
+    if (!offsets.write(reinterpret_cast<const char*>(off_len), sizeof(off_len))) {
+        std::cerr << "ExternalDedup: cannot write " << offsets_name << std::endl;
+        failed = true;
+        return false;
+    }
+
+    run_recs.push_back(run_words.size());
+    run_words.push_back(key.size());
+    run_words.push_back(num_models++);
+    run_words.insert(run_words.end(), key.data(), key.data() + key.size());
+    if ((run_words.size() + run_recs.size()) * sizeof(uint64_t) >= budget && !write_run()) {
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+// orders records by key (length first), then by index
+static bool
+record_less(const uint64_t* a, const uint64_t* b)
+{
+    if (a[0] != b[0])
+        return a[0] < b[0];
+    for (size_t idx = 2; idx < 2 + a[0]; ++idx) {
+        if (a[idx] != b[idx])
+            return a[idx] < b[idx];
+    }
+    return a[1] < b[1];
+}
+
+static bool
+same_key(const uint64_t* a, const uint64_t* b)
+{
+    return a[0] == b[0] && memcmp(a + 2, b + 2, a[0] * sizeof(uint64_t)) == 0;
+}
+
+std::string
+ExternalDedup::run_name()
+{
+    return dir + "/isonaut_run_" + std::to_string(getpid()) + "_" + std::to_string(num_files++) + ".bin";
+}
+
+bool
+ExternalDedup::write_run()
+{
+    if (run_recs.empty())
+        return true;
+    const uint64_t* words = run_words.data();
+    std::sort(run_recs.begin(), run_recs.end(),
+              [words](size_t a, size_t b) { return record_less(words + a, words + b); });
+
+    num_runs++;
+    run_names.push_back(run_name());
+    std::ofstream run(run_names.back().c_str(), std::ios::binary | std::ios::trunc);
+    if (!run) {
+        std::cerr << "ExternalDedup: cannot create " << run_names.back() << std::endl;
+        return false;
+    }
+    const uint64_t* prev = nullptr;
+    for (size_t rec : run_recs) {
+        const uint64_t* cur = words + rec;
+        if (prev != nullptr && same_key(prev, cur))   // a later model of the same class
+            continue;
+        run.write(reinterpret_cast<const char*>(cur), (2 + cur[0]) * sizeof(uint64_t));
+        prev = cur;
+    }
+    run_words.clear();
+    run_recs.clear();
+    if (!run) {
+        std::cerr << "ExternalDedup: cannot write " << run_names.back() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+namespace {
+
+// the current record of a run file in the merge
+struct RunReader {
+    std::ifstream         file;
+    std::vector<uint64_t> rec;
+
+    bool next() {
+        uint64_t head[2];
+        if (!file.read(reinterpret_cast<char*>(head), sizeof(head)))
+            return false;
+        rec.resize(2 + head[0]);
+        rec[0] = head[0];
+        rec[1] = head[1];
+        return bool(file.read(reinterpret_cast<char*>(rec.data() + 2), head[0] * sizeof(uint64_t)));
+    };
+};
+
+}
+
+bool
+ExternalDedup::merge(const std::vector<std::string>& names, const std::function<void(const std::vector<uint64_t>&)>& first)
+{
+    /* k-way merge of the sorted runs in names, calling first on the first record of each key.
+       Each run has one record per key, so within a group of equal keys the records come from
+       different runs; the first of the group in the merge order has the smallest index.
+     */
+    std::vector<std::unique_ptr<RunReader>> readers;
+    for (auto& name : names) {
+        readers.emplace_back(new RunReader());
+        readers.back()->file.open(name.c_str(), std::ios::binary);
+        if (!readers.back()->file) {
+            std::cerr << "ExternalDedup: cannot read " << name << std::endl;
+            return false;
+        }
+    }
+    auto greater = [&readers](size_t a, size_t b) {
+        return record_less(readers[b]->rec.data(), readers[a]->rec.data());
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+    for (size_t r = 0; r < readers.size(); ++r) {
+        if (readers[r]->next())
+            heap.push(r);
+    }
+    std::vector<uint64_t> last;
+    while (!heap.empty()) {
+        size_t r = heap.top();
+        heap.pop();
+        const std::vector<uint64_t>& rec = readers[r]->rec;
+        if (last.empty() || !same_key(last.data(), rec.data())) {
+            first(rec);
+            last = rec;
+        }
+        if (readers[r]->next())
+            heap.push(r);
+    }
+    return true;
+}
+
+bool
+ExternalDedup::merge_runs(std::vector<bool>& first_seen)
+{
+    /* While there are more than Merge_fan_in runs, each group of Merge_fan_in of them is
+       merged into a new run, which keeps the first record of each key; then the remaining
+       runs are merged into first_seen.
+     */
+    while (run_names.size() > Merge_fan_in) {
+        std::vector<std::string> merged;
+        for (size_t begin = 0; begin < run_names.size(); begin += Merge_fan_in) {
+            const size_t end = std::min(begin + Merge_fan_in, run_names.size());
+            std::vector<std::string> group(run_names.begin() + begin, run_names.begin() + end);
+            if (group.size() == 1) {
+                merged.push_back(group[0]);
+                continue;
+            }
+            merged.push_back(run_name());
+            std::ofstream run(merged.back().c_str(), std::ios::binary | std::ios::trunc);
+            bool ok = run && merge(group, [&run](const std::vector<uint64_t>& rec) {
+                run.write(reinterpret_cast<const char*>(rec.data()), rec.size() * sizeof(uint64_t));
+            });
+            run.close();
+            if (!ok || !run) {
+                std::cerr << "ExternalDedup: cannot write " << merged.back() << std::endl;
+                run_names.insert(run_names.end(), merged.begin(), merged.end());   // removed at the end
+                return false;
+            }
+            for (auto& name : group)
+                std::remove(name.c_str());
+        }
+        run_names.swap(merged);
+    }
+    return merge(run_names, [this, &first_seen](const std::vector<uint64_t>& rec) {
+        first_seen[rec[1]] = true;
+        num_classes++;
+    });
+}
+
+bool
+ExternalDedup::finish(const char* input, std::ostream& os)
+{
+    /* Merges the runs and writes the first model of each class, in input order.
+       Returns true if success, false otherwise (with a message on std::cerr), also when
+       an earlier add failed.
+     */
+    if (failed || !write_run())
+        return false;
+    offsets.close();
+    std::vector<bool> first_seen(num_models, false);
+    if (!merge_runs(first_seen))
+        return false;
+
+    std::ifstream offs(offsets_name.c_str(), std::ios::binary);
+    uint64_t off_len[2];
+    for (size_t idx = 0; idx < num_models && offs.read(reinterpret_cast<char*>(off_len), sizeof(off_len)); ++idx) {
+        if (first_seen[idx])
+            os.write(input + off_len[0], off_len[1]);
+    }
+    remove_files();
+    return true;
+}
+
+void
+ExternalDedup::remove_files()
+{
+    if (offsets.is_open())
+        offsets.close();
+    if (!offsets_name.empty())
+        std::remove(offsets_name.c_str());
+    offsets_name.clear();
+    for (auto& name : run_names)
+        std::remove(name.c_str());
+    run_names.clear();
+}
@@ -0,0 +1,63 @@
+/* external_dedup.h : bounded-memory dedup with sorted runs on disk. */
+/* Version 1.1, July 2023. */
+
+#ifndef EXTERNAL_DEDUP_H
+#define EXTERNAL_DEDUP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "canon_key.h"
+
+/*  Dedup of more canonical keys than fit in memory.  The keys are collected with the
+    input index of their model until the run buffer reaches the memory budget, then they
+    are sorted by (key, index) and written, one record per distinct key, to a run file.
+    The offset and length of every model are written, in input order, to an offsets file.
+    At the end the runs are merged; the smallest index of each key marks the first model
+    seen in its class, and those models are copied out of the input in input order.
+    Up to Merge_fan_in runs are open at once: with more, groups of them are first merged
+    into longer runs.  Once a write fails, add and finish return false.
+ */
+class ExternalDedup {
+public:
+    static const size_t Merge_fan_in = 64;
+
+private:
+    std::string                 dir;
+    size_t                      budget;         // in bytes
+    std::vector<uint64_t>       run_words;      // records: length in words, index, words of the key
+    std::vector<size_t>         run_recs;       // start of each record in run_words
+    std::vector<std::string>    run_names;
+    std::string                 offsets_name;
+    std::ofstream               offsets;
+    size_t                      num_models;
+    size_t                      num_classes;
+    size_t                      num_runs;
+    size_t                      num_files;      // run files created, for their names
+    bool                        failed;
+
+private:
+    std::string run_name();
+    bool   write_run();
+    bool   merge(const std::vector<std::string>& names, const std::function<void(const std::vector<uint64_t>&)>& first);
+    bool   merge_runs(std::vector<bool>& first_seen);
+    void   remove_files();
+
+public:
+    ExternalDedup() : budget(0), num_models(0), num_classes(0), num_runs(0), num_files(0), failed(false) {};
+    ~ExternalDedup() { remove_files(); };
+
+    bool   open(const std::string& spill_dir, size_t budget_bytes);
+    bool   is_open() const { return offsets.is_open(); };
+    bool   add(const CanonKey& key, uint64_t offset, uint64_t len);
+    bool   finish(const char* input, std::ostream& os);    // writes the first model of each class
+    size_t runs() const { return num_runs; };
+    size_t classes() const { return num_classes; };
+};
+
+#endif
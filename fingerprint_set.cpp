@@ -0,0 +1,212 @@
+/* fingerprint_set.cpp
+ */
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <map>
+#include <unistd.h>
+#include "fingerprint_set.h"
+
+bool
+FingerprintSet::find_slot(uint64_t lo, uint64_t hi, size_t& slot) const
+{
+    /* Linear probing from the home slot of lo.  Returns true with slot at the fingerprint if
+       found, false with slot at the empty slot where it would go otherwise.
+     */
+    const size_t mask = capacity() - 1;
+    size_t probes = 1;
+    for (slot = lo & mask; slots[2*slot] != 0 || slots[2*slot+1] != 0; slot = (slot + 1) & mask, ++probes) {
+        if (slots[2*slot] == lo && slots[2*slot+1] == hi)
+            break;
+    }
+    num_lookups++;
+    total_probes += probes;
+    if (probes > max_probes)
+        max_probes = probes;
+    return slots[2*slot] != 0 || slots[2*slot+1] != 0;
+}
+
+void
+FingerprintSet::grow()
+{
+    std::vector<uint64_t> old_slots(std::max<size_t>(2048, 2 * slots.size()), 0);
+    old_slots.swap(slots);
+    const size_t mask = capacity() - 1;
+    for (size_t idx = 0; idx < old_slots.size(); idx += 2) {
+        if (old_slots[idx] == 0 && old_slots[idx+1] == 0)
+            continue;
+        size_t slot = old_slots[idx] & mask;
+        while (slots[2*slot] != 0 || slots[2*slot+1] != 0)
+            slot = (slot + 1) & mask;
+        slots[2*slot] = old_slots[idx];
+        slots[2*slot+1] = old_slots[idx+1];
+    }
+}
+
+bool
+FingerprintSet::contains(uint64_t lo, uint64_t hi) const
+{
+    if (lo == 0 && hi == 0)   // (0, 0) marks empty slots
+        hi = 1;
+    size_t slot;
+    return !slots.empty() && find_slot(lo, hi, slot);
+}
+
+bool
+FingerprintSet::insert(uint64_t lo, uint64_t hi)
+{
+    if (lo == 0 && hi == 0)
+        hi = 1;
+    // keeps the load factor at most 0.7
+    if (10 * (num_keys + 1) > 7 * capacity())
+        grow();
+    size_t slot;
+    if (find_slot(lo, hi, slot))
+        return false;
+    slots[2*slot] = lo;
+    slots[2*slot+1] = hi;
+    num_keys++;
+    return true;
+}
+
+double
+FingerprintSet::collision_probability() const
+{
+    // birthday bound: probability that any two of the distinct keys stored share a fingerprint
+    double n = num_keys;
+    return std::min(1.0, n * (n - 1) / 2.0 * std::ldexp(1.0, -128));
+}
+
+void
+FingerprintSet::print_stats(std::ostream& os) const
+{
+    os << "% Fingerprint set: " << num_keys << " fingerprints in " << capacity() << " slots, load factor "
+       << load_factor() << ", " << memory_bytes() / 1000000.0 << " MB" << std::endl;
+    os << "% Fingerprint set probes: mean " << (num_lookups? double(total_probes) / num_lookups : 0.0)
+       << " per lookup, max " << max_probes << std::endl;
+    os << "% Fingerprint collision probability (birthday bound): " << collision_probability() << std::endl;
+}
+
+bool
+CollisionCheck::open(const std::string& dir)
+{
+    /* Returns true if success, false otherwise (with a message on std::cerr). */
+    for (size_t bucket = 0; bucket < Num_buckets; ++bucket) {
+        file_names.push_back(dir + "/isonaut_fp_" + std::to_string(getpid()) + "_" + std::to_string(bucket) + ".bin");
+        files.emplace_back(file_names.back().c_str(), std::ios::binary | std::ios::trunc);
+        stored_bytes.push_back(0);
+        if (!files.back()) {
+            std::cerr << "CollisionCheck: cannot create " << file_names.back() << std::endl;
+            remove_files();
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+CollisionCheck::add(uint64_t lo, uint64_t hi, const CanonKey& key, bool stored)
+{
+    // record: lo, hi, stored flag, length in words, words
+    const size_t bucket = hi % Num_buckets;
+    uint64_t header[4] = {lo, hi, stored, key.size()};
+    files[bucket].write(reinterpret_cast<const char*>(header), sizeof(header));
+    files[bucket].write(reinterpret_cast<const char*>(key.data()), key.size() * sizeof(uint64_t));
+    if (stored)
+        stored_bytes[bucket] += sizeof(header) + key.size() * sizeof(uint64_t);
+    num_spilled++;
+}
+
+// reads the next record of f into header and words
+static bool
+read_record(std::ifstream& f, uint64_t header[4], std::vector<uint64_t>& words)
+{
+    if (!f.read(reinterpret_cast<char*>(header), 4 * sizeof(uint64_t)))
+        return false;
+    words.resize(header[3]);
+    return bool(f.read(reinterpret_cast<char*>(words.data()), words.size() * sizeof(uint64_t)));
+}
+
+size_t
+CollisionCheck::check_bucket(const std::string& name, size_t bytes, int level)
+{
+    /* Collisions in one bucket file, which is removed.  If its stored keys would take more
+       than Max_bucket_bytes, the records are first split by 16 bits of lo chosen by level
+       (the fingerprints of a bucket share hi % Num_buckets only) into sub-buckets.
+     */
+    uint64_t header[4];
+    std::vector<uint64_t> words;
+    if (bytes > Max_bucket_bytes && level < Max_split_level) {
+        const size_t num_parts = std::min<size_t>(bytes / Max_bucket_bytes * 2 + 1, 1 << 10);
+        std::vector<std::string>  part_names;
+        std::vector<std::ofstream> parts;
+        std::vector<size_t>        part_bytes(num_parts, 0);
+        for (size_t p = 0; p < num_parts; ++p) {
+            part_names.push_back(name + "." + std::to_string(p));
+            parts.emplace_back(part_names.back().c_str(), std::ios::binary | std::ios::trunc);
+        }
+        {
+            std::ifstream f(name.c_str(), std::ios::binary);
+            while (read_record(f, header, words)) {
+                const size_t p = ((header[0] >> (16 * level)) & 0xFFFF) % num_parts;
+                parts[p].write(reinterpret_cast<const char*>(header), sizeof(header));
+                parts[p].write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint64_t));
+                if (header[2])
+                    part_bytes[p] += sizeof(header) + words.size() * sizeof(uint64_t);
+            }
+        }
+        std::remove(name.c_str());
+        parts.clear();
+        size_t collisions = 0;
+        for (size_t p = 0; p < num_parts; ++p)
+            collisions += check_bucket(part_names[p], part_bytes[p], level + 1);
+        return collisions;
+    }
+
+    // the stored key of each fingerprint first, then the distinct keys of hits that differ
+    std::map<std::pair<uint64_t, uint64_t>, std::vector<std::vector<uint64_t>>> keys;
+    {
+        std::ifstream f(name.c_str(), std::ios::binary);
+        while (read_record(f, header, words)) {
+            if (header[2])
+                keys[std::make_pair(header[0], header[1])].push_back(words);
+        }
+    }
+    size_t collisions = 0;
+    std::ifstream f(name.c_str(), std::ios::binary);
+    while (read_record(f, header, words)) {
+        if (header[2])
+            continue;
+        auto& same_fp = keys[std::make_pair(header[0], header[1])];
+        if (std::find(same_fp.begin(), same_fp.end(), words) == same_fp.end()) {
+            if (!same_fp.empty())
+                collisions++;
+            same_fp.push_back(words);
+        }
+    }
+    f.close();
+    std::remove(name.c_str());
+    return collisions;
+}
+
+size_t
+CollisionCheck::check()
+{
+    size_t collisions = 0;
+    for (auto& f : files)
+        f.close();
+    for (size_t bucket = 0; bucket < file_names.size(); ++bucket)
+        collisions += check_bucket(file_names[bucket], stored_bytes[bucket], 1);
+    remove_files();
+    return collisions;
+}
+
+void
+CollisionCheck::remove_files()
+{
+    files.clear();
+    for (auto& name : file_names)
+        std::remove(name.c_str());
+    file_names.clear();
+    stored_bytes.clear();
+}
@@ -0,0 +1,82 @@
+/* fingerprint_set.h : dedup on 128-bit fingerprints of canonical keys. */
+/* Version 1.1, July 2023. */
+
+#ifndef FINGERPRINT_SET_H
+#define FINGERPRINT_SET_H
+
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "canon_key.h"
+
+/*  Open-addressing set of 128-bit fingerprints stored in the slots themselves: 16 bytes
+    per slot and no key storage at all.  Two different keys with the same fingerprint are
+    taken as isomorphic; CollisionCheck can measure how often that happened.
+ */
+class FingerprintSet {
+private:
+    std::vector<uint64_t> slots;      // lo, hi pairs; (0, 0) is an empty slot
+    size_t                num_keys;
+
+    mutable size_t num_lookups;
+    mutable size_t total_probes;
+    mutable size_t max_probes;
+
+private:
+    bool find_slot(uint64_t lo, uint64_t hi, size_t& slot) const;
+    void grow();
+
+public:
+    FingerprintSet() : num_keys(0), num_lookups(0), total_probes(0), max_probes(0) {};
+
+    bool   contains(uint64_t lo, uint64_t hi) const;
+    bool   insert(uint64_t lo, uint64_t hi);      // true if the fingerprint was not in the set
+
+    size_t size() const { return num_keys; };
+    size_t capacity() const { return slots.size() / 2; };
+    double load_factor() const { return slots.empty()? 0.0 : double(num_keys) / capacity(); };
+    size_t memory_bytes() const { return slots.size() * sizeof(uint64_t); };
+    double collision_probability() const;
+
+    void   print_stats(std::ostream& os) const;
+};
+
+/*  Verification of a fingerprint-only run.  The key stored under each new fingerprint and
+    the keys of the fingerprint hits are spilled, with their fingerprint and which of the
+    two they are, into one of Num_buckets files chosen by the fingerprint.  At the end each
+    bucket is checked on its own: only its stored keys are held in memory, one per
+    fingerprint, while the hits are streamed past them, which counts the classes that were
+    wrongly merged.  A bucket whose stored keys take more than Max_bucket_bytes is first
+    split into smaller ones by another part of the fingerprint.
+ */
+class CollisionCheck {
+private:
+    static const size_t Num_buckets = 64;
+    static const size_t Max_bucket_bytes = size_t(64) << 20;
+    static const int    Max_split_level = 3;
+
+    std::vector<std::string>    file_names;
+    std::vector<std::ofstream>  files;
+    std::vector<size_t>         stored_bytes;     // per bucket
+    size_t                      num_spilled;
+
+private:
+    size_t check_bucket(const std::string& name, size_t bytes, int level);
+
+public:
+    CollisionCheck() : num_spilled(0) {};
+    ~CollisionCheck() { remove_files(); };
+
+    bool   open(const std::string& dir);
+    bool   is_open() const { return !files.empty(); };
+    void   add(uint64_t lo, uint64_t hi, const CanonKey& key, bool stored);
+    size_t check();            // number of extra keys found under an already used fingerprint
+    size_t spilled() const { return num_spilled; };
+    void   remove_files();
+};
+
+#endif
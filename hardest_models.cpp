@@ -0,0 +1,96 @@
+/* hardest_models.cpp
+ */
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include "hardest_models.h"
+
+bool
+HardestModels::qualifies(const std::vector<Entry>& heap, bool (*more)(const Entry&, const Entry&),
+                         const Entry& e) const
+{
+    // heap.front() is the least costly entry kept
+    return heap.size() < max_size || more(e, heap.front());
+}
+
+void
+HardestModels::push(std::vector<Entry>& heap, bool (*more)(const Entry&, const Entry&), const Entry& e)
+{
+    if (heap.size() == max_size) {
+        std::pop_heap(heap.begin(), heap.end(), more);
+        heap.pop_back();
+    }
+    heap.push_back(e);
+    std::push_heap(heap.begin(), heap.end(), more);
+}
+
+void
+HardestModels::add(const SearchCost& cost, const char* text, size_t text_len)
+{
+    /* Models labelled by nauty, the direct search or the functional canonizer; cost is
+       empty for an exact repeat or an empty model, which is not counted. */
+    if (cost.calls + cost.direct_calls == 0)
+        return;
+    Entry e;
+    e.cost = cost;
+    e.seq = num_searched++;
+    const bool slow = qualifies(by_cycles, more_cycles, e);
+    const bool deep = qualifies(by_nodes, more_nodes, e);
+    if (!slow && !deep)
+        return;
+    e.text.assign(text, text_len);
+    if (slow)
+        push(by_cycles, more_cycles, e);
+    if (deep)
+        push(by_nodes, more_nodes, e);
+}
+
+bool
+HardestModels::write(const std::string& file_name, double cycles_per_second) const
+{
+    /* Each model once, by decreasing canonizer cycles, after a % line with its costs and its
+       ranks in the two lists (0 if it is not in one).
+     */
+    std::vector<const Entry*> entries;
+    for (auto& e : by_cycles)
+        entries.push_back(&e);
+    for (auto& e : by_nodes)
+        entries.push_back(&e);
+    std::sort(entries.begin(), entries.end(), [](const Entry* a, const Entry* b) {
+        return a->cost.cycles != b->cost.cycles? a->cost.cycles > b->cost.cycles : a->seq < b->seq;
+    });
+    entries.erase(std::unique(entries.begin(), entries.end(), [](const Entry* a, const Entry* b) {
+        return a->seq == b->seq;
+    }), entries.end());
+
+    auto rank = [](const std::vector<Entry>& heap, bool (*more)(const Entry&, const Entry&), const Entry& e) {
+        size_t r = 1;
+        bool   found = false;
+        for (auto& other : heap) {
+            found |= other.seq == e.seq;
+            r += more(other, e) || (!more(e, other) && other.seq < e.seq);
+        }
+        return found? r : 0;
+    };
+    std::ofstream out(file_name);
+    out << "% " << entries.size() << " hardest of " << num_searched << " models canonicalized, the "
+        << max_size << " slowest and the " << max_size << " with the most search-tree nodes" << std::endl;
+    for (auto e : entries) {
+        out << "% cycles: " << e->cost.cycles;
+        if (cycles_per_second > 0)
+            out << " (" << e->cost.cycles / cycles_per_second * 1e6 << " us)";
+        out << ", numnodes: " << e->cost.numnodes << ", nauty calls: " << e->cost.calls
+            << ", direct calls: " << e->cost.direct_calls << ", maxlevel: " << e->cost.maxlevel
+            << ", grpsize: " << e->cost.grpsize1 << "e" << e->cost.grpsize2
+            << ", rank by cycles: " << rank(by_cycles, more_cycles, *e)
+            << ", rank by numnodes: " << rank(by_nodes, more_nodes, *e) << std::endl;
+        out << e->text;
+        if (!e->text.empty() && e->text.back() != '\n')
+            out << std::endl;
+    }
+    if (!out) {
+        std::cerr << "Cannot write the hardest models to " << file_name << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,49 @@
+/* hardest_models.h : the models whose canonical labellings took longest, for --hardest. */
+/* Version 1.1, July 2023. */
+
+#ifndef HARDEST_MODELS_H
+#define HARDEST_MODELS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "run_stats.h"
+
+/*  Two bounded min-heaps of the models canonicalized so far: the max_size ones with the
+    most cycles in the canonizers (nauty, the direct search, the functional canonizer) and
+    the max_size ones with the most search-tree nodes.  A model's text is copied only when
+    it enters one of them.  write() puts the union in a file that is itself an input for
+    isonaut (the costs are on % lines), slowest first.
+ */
+class HardestModels {
+private:
+    struct Entry {
+        SearchCost  cost;
+        size_t      seq;    // number of the model among those searched, to merge the heaps
+        std::string text;
+    };
+    size_t             max_size;
+    size_t             num_searched;
+    std::vector<Entry> by_cycles;
+    std::vector<Entry> by_nodes;
+
+private:
+    static bool more_cycles(const Entry& a, const Entry& b) { return a.cost.cycles > b.cost.cycles; };
+    static bool more_nodes(const Entry& a, const Entry& b) { return a.cost.numnodes > b.cost.numnodes; };
+    bool        qualifies(const std::vector<Entry>& heap, bool (*more)(const Entry&, const Entry&),
+                          const Entry& e) const;
+    void        push(std::vector<Entry>& heap, bool (*more)(const Entry&, const Entry&), const Entry& e);
+
+public:
+    HardestModels() : max_size(0), num_searched(0) {};
+
+    void   set_capacity(size_t num_models) { max_size = num_models; };
+    bool   is_enabled() const { return max_size > 0; };
+    void   add(const SearchCost& cost, const char* text, size_t text_len);
+    bool   write(const std::string& file_name, double cycles_per_second) const;
+    size_t searched() const { return num_searched; };
+};
+
+#endif
@@ -1,9 +1,23 @@
 
 #include <sstream>
 #include <iostream>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
 #include "nauty_utils.h"
+#include "mapped_file.h"
 #include "isofilter.h"
 
+// with --stats (rs not null), the cycles since start go to phase, see RunStats::lap
+static inline void
+lap(RunStats* rs, RunStats::Phase phase, uint64_t& start)
+{
+    if (rs != nullptr)
+        rs->lap(phase, start);
+}
+
 /*
 interpretation( 3, [number=1, seconds=0], [
   function('(_), [0,1,2 ]),
@@ -19,11 +33,54 @@ int
 IsoFilter::process_all_models()
 {
     const bool use_std = opt.file_name == "-";
+    if (!CanonWorkspace().set_invariant(opt.invariant, opt.invararg, opt.mininvarlevel, opt.maxinvarlevel)) {
+        std::cerr << "Unknown vertex invariant: " << opt.invariant << std::endl;
+        return 1;
+    }
+    if (!CanonWorkspace().set_engine(opt.engine)) {
+        std::cerr << "Unknown engine: " << opt.engine << std::endl;
+        return 1;
+    }
+    if (opt.mem_budget > 0 && use_std) {
+        std::cerr << "--mem-budget needs a model file, the models are copied out of it at the end" << std::endl;
+        return 1;
+    }
+    if (opt.mem_budget > 0 && opt.out_cg) {
+        std::cerr << "-c is ignored with --mem-budget" << std::endl;
+        opt.out_cg = false;
+    }
+    if (opt.fingerprint && (!opt.load_index.empty() || !opt.save_index.empty() || !opt.query_index.empty())) {
+        std::cerr << "--load-index, --save-index and --query need the full keys, not --fingerprint" << std::endl;
+        return 1;
+    }
+    if (opt.fingerprint && opt.mem_budget > 0) {
+        std::cerr << "--fingerprint cannot be used with --mem-budget, which keeps the full keys on disk" << std::endl;
+        return 1;
+    }
+    if (opt.mem_budget > 0 && !opt.save_index.empty()) {
+        std::cerr << "--save-index is not supported with --mem-budget" << std::endl;
+        return 1;
+    }
+    if (!opt.query_index.empty() && (!opt.load_index.empty() || !opt.save_index.empty() || opt.mem_budget > 0)) {
+        std::cerr << "--query cannot be used with --load-index, --save-index or --mem-budget" << std::endl;
+        return 1;
+    }
+    if (!opt.load_index.empty() || !opt.query_index.empty()) {
+        if (!index.open(opt.load_index.empty()? opt.query_index : opt.load_index, workspace(0).key_form()))
+            return 1;
+    }
+    const bool use_mmap = (opt.use_mmap || opt.mem_budget > 0) && !use_std;
     std::istream* fp = &std::cin;
     std::ifstream filep;
+    MappedFile    mapped;
     std::string   check_sym = opt.check_sym;
 
-    if (!use_std) {
+    if (use_mmap) {
+        if (!mapped.open(opt.file_name))
+            return 1;
+        input_begin = mapped.begin();
+    }
+    else if (!use_std) {
         filep.open(opt.file_name.c_str());
         // debug print: std::cout << opt.file_name << std::endl;
         fp = &filep;
@@ -32,12 +89,109 @@ IsoFilter::process_all_models()
         check_sym.insert(0, ",");
         check_sym.append(",");
     }
+    if (opt.fingerprint && !opt.verify_dir.empty()) {
+        if (!fp_check.open(opt.verify_dir))
+            return 1;
+    }
+    if (opt.mem_budget > 0) {
+        if (!external.open(opt.spill_dir, opt.mem_budget * 1000000))
+            return 1;
+    }
+    // the models with the costliest searches, kept as they are canonicalized
+    if (!opt.hardest.empty())
+        hardest.set_capacity(opt.hardest_count);
+    // --query prints every model not in the index, the repeats too
+    if (opt.query_index.empty())
+        repeats.set_capacity(opt.repeat_cache * 1000000);
+    // lazy canonicalization needs the key of every model printed (-c), looked up in an index or
+    // saved to one, and the parallel readers canonicalize whole batches anyway
+    use_lazy = opt.lazy && !opt.out_cg && !index.is_open() && opt.save_index.empty() &&
+               opt.mem_budget == 0 && opt.num_threads <= 1;
     std::istream& fs = *fp;
-    bool   done = false;
     size_t models_count = 0;
 
     double start_cpu_time = read_cpu_time();
     unsigned start_wall_clock = read_wall_clock();
+    const uint64_t start_cycles = RunStats::cycles();
+    const auto     start_clock = std::chrono::steady_clock::now();
+    if (use_mmap && opt.num_threads > 1)
+        models_count = process_buffer_parallel(mapped.begin(), mapped.end(), check_sym);
+    else if (use_mmap)
+        models_count = process_buffer(mapped.begin(), mapped.end(), check_sym);
+    else if (opt.num_threads > 1)
+        models_count = process_models_parallel(fs, check_sym);
+    else
+        models_count = process_models(fs, check_sym);
+
+    if (!use_std)
+        filep.close();
+    double total_cpu_time = read_cpu_time() - start_cpu_time;
+    unsigned elapsed_time = read_wall_clock() - start_wall_clock;
+    if (external.is_open()) {
+        if (!external.finish(input_begin, std::cout))
+            return 1;
+        std::cout << "% Number of models processed: " << models_count << std::endl;
+        std::cout << "% Number of non-iso models: " << external.classes() << std::endl;
+        std::cout << "% External dedup: " << external.runs() << " sorted runs merged" << std::endl;
+    }
+    else if (!opt.query_index.empty()) {
+        std::cout << "% Number of models processed: " << models_count << std::endl;
+        std::cout << "% Number of models not in the index: " << num_new << std::endl;
+    }
+    else {
+        std::cout << "% Number of models processed: " << models_count << std::endl;
+        std::cout << "% Number of non-iso models: " << num_non_iso() << std::endl;
+        if (opt.fingerprint)
+            non_iso_fps.print_stats(std::cout);
+        else
+            non_iso_hash.print_stats(std::cout);
+    }
+    if (repeats.is_enabled())
+        std::cout << "% Exact repeats skipped: " << repeats.hits() << " (" << repeats.size() << " models cached, "
+                  << repeats.evicted() << " evicted)" << std::endl;
+    double nodes = 0;
+    for (auto& ws : workspaces)
+        nodes += ws->total_nodes;
+    std::cout << "% Nauty search-tree nodes: " << size_t(nodes) << std::endl;
+    if (use_lazy) {
+        std::cout << "% Lazy canonicalization: " << lazy_buckets.size() << " invariant classes, "
+                  << num_lazy_pending << " models never canonicalized" << std::endl;
+    }
+    if (index.is_open())
+        std::cout << "% Key index: " << index.size() << " keys in "
+                  << (opt.load_index.empty()? opt.query_index : opt.load_index) << std::endl;
+    if (!opt.save_index.empty()) {
+        if (!save_index())
+            return 1;
+        std::cout << "% Key index: " << index.size() + non_iso_hash.size() << " keys saved to " << opt.save_index << std::endl;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_clock).count();
+    const double cycles_per_second = seconds > 0? (RunStats::cycles() - start_cycles) / seconds : 0;
+    if (!opt.stats.empty()) {
+        if (!write_stats(models_count, cycles_per_second))
+            return 1;
+        std::cout << "% Statistics written to " << opt.stats << std::endl;
+    }
+    if (hardest.is_enabled()) {
+        if (!hardest.write(opt.hardest, cycles_per_second))
+            return 1;
+        std::cout << "% Hardest models written to " << opt.hardest << std::endl;
+    }
+    if (fp_check.is_open()) {
+        size_t spilled = fp_check.spilled();
+        std::cout << "% Fingerprint collisions found: " << fp_check.check() << " (verified " << spilled
+                  << " spilled keys)" << std::endl;
+    }
+    std::cout << "% Total CPU time: " << total_cpu_time << " seconds." << std::endl;
+    std::cout << "% Elapsed time: " << elapsed_time << " seconds." << std::endl;
+    return 0;
+}
+
+size_t
+IsoFilter::process_models(std::istream& fs, const std::string& check_sym)
+{
+    /* Reads the models line by line from the stream.  Returns the number of models read. */
+    size_t models_count = 0;
     std::string line;
     while (!fs.eof()) {
         getline(fs, line);
@@ -45,30 +199,444 @@ IsoFilter::process_all_models()
             continue; 
         if (line.find("interpretation") != std::string::npos) {
             models_count++;
+            RunStats* rs = phase_stats(workspace(0));
+            uint64_t start = rs? RunStats::cycles() : 0;
             Model m;
             m.fill_meta_data(line);
             m.parse_model(fs, check_sym);
+            lap(rs, RunStats::Parse_phase, start);
+            const bool repeat = is_repeat(m);
+            lap(rs, RunStats::Lookup_phase, start);
+            if (repeat)
+                continue;
+            if (!use_lazy || !output_if_first_of_invariant(m, check_sym))
+                output_if_non_iso(m);
+        }
+    }
+    return models_count;
+}
+
+size_t
+IsoFilter::process_buffer(const char* pos, const char* end, const std::string& check_sym)
+{
+    /* Scans the models in place in the buffer [pos, end).  Returns the number of models read. */
+    size_t models_count = 0;
+    while (pos < end) {
+        const char* eol = line_end(pos, end);
+        if (*pos == '%' || find_in_line(pos, eol, Model::Interpretation_label) == eol) {
+            pos = next_line(eol, end);
+            continue;
+        }
+        models_count++;
+        RunStats* rs = phase_stats(workspace(0));
+        uint64_t start = rs? RunStats::cycles() : 0;
+        Model m;
+        m.parse_model(pos, end, check_sym);
+        lap(rs, RunStats::Parse_phase, start);
+        const bool repeat = is_repeat(m);
+        lap(rs, RunStats::Lookup_phase, start);
+        if (repeat)
+            continue;
+        if (external.is_open()) {
+            if (!spill_model(m))   // the external dedup failed, finish() says so
+                break;
+        }
+        else if (!use_lazy || !output_if_first_of_invariant(m, check_sym))
+            output_if_non_iso(m);
+    }
+    return models_count;
+}
+
+void
+IsoFilter::output_if_non_iso(Model& m)
+{
+    CanonWorkspace& ws = workspace(0);
+    RunStats* rs = phase_stats(ws);
+    uint64_t start = rs? RunStats::cycles() : 0;
+    ws.model_search = SearchCost();
+    if (!m.build_graph(ws, opt.out_cg))  // is it empty graph?
+        return; 
+    lap(rs, RunStats::Graph_phase, start);
+    add_hardest(ws.model_search, m);
+    m.canonical_key(key);
+    lap(rs, RunStats::Key_phase, start);
+    const bool non_iso = is_non_iso_key(key);
+    lap(rs, RunStats::Lookup_phase, start);
+
+    if (non_iso) {
+        std::string canon_str;
+        if (opt.out_cg)
+            canon_str = m.cg_to_string("\n", opt.shorten_str);
+        m.print_model(std::cout, canon_str, opt.out_cg);
+        lap(rs, RunStats::Output_phase, start);
+    }
+}
+
+bool
+IsoFilter::output_if_first_of_invariant(Model& m, const std::string& check_sym)
+{
+    /* Isomorphic models have the same invariant hash, so a model whose hash no earlier
+       model had is the first of its class: it is printed without canonicalizing it, and its
+       text is kept.  When a second model comes with that hash, the kept one is canonicalized
+       (its key entered) and the new one goes through output_if_non_iso as usual.
+       Returns true if m was printed here.
+     */
+    if (m.un_ops.empty() && m.bin_ops.empty() && m.bin_rels.empty())   // build_graph rejects it
+        return false;
+    CanonWorkspace& ws = workspace(0);
+    RunStats* rs = phase_stats(ws);
+    uint64_t start = rs? RunStats::cycles() : 0;
+    auto bucket = lazy_buckets.emplace(m.invariant_hash(opt.anti_iso), std::string());
+    std::string& first_text = bucket.first->second;
+    lap(rs, RunStats::Lookup_phase, start);
+    if (bucket.second) {
+        if (m.text_begin != nullptr)
+            first_text.assign(m.text_begin, m.text_len);
+        else
+            first_text = m.model_str;
+        num_lazy_pending++;
+        m.print_text(std::cout);
+        lap(rs, RunStats::Output_phase, start);
+        return true;
+    }
+    if (!first_text.empty()) {
+        const char* pos = first_text.data();
+        Model first;
+        first.parse_model(pos, pos + first_text.size(), check_sym);
+        lap(rs, RunStats::Parse_phase, start);
+        ws.model_search = SearchCost();
+        if (first.build_graph(ws)) {
+            lap(rs, RunStats::Graph_phase, start);
+            add_hardest(ws.model_search, first);
+            first.canonical_key(key);
+            lap(rs, RunStats::Key_phase, start);
+            is_non_iso_key(key);
+            lap(rs, RunStats::Lookup_phase, start);
+        }
+        std::string().swap(first_text);
+        num_lazy_pending--;
+    }
+    return false;
+}
 
-            if (!m.build_graph())  // is it empty graph?
-                continue; 
+bool
+IsoFilter::spill_model(Model& m)
+{
+    /* Returns false if the external dedup failed. */
+    CanonWorkspace& ws = workspace(0);
+    RunStats* rs = phase_stats(ws);
+    uint64_t start = rs? RunStats::cycles() : 0;
+    ws.model_search = SearchCost();
+    if (!m.build_graph(ws, false))  // is it empty graph?
+        return true;
+    lap(rs, RunStats::Graph_phase, start);
+    add_hardest(ws.model_search, m);
+    m.canonical_key(key);
+    lap(rs, RunStats::Key_phase, start);
+    const bool ok = (index.is_open() && index.contains(key)) || external.add(key, m.text_begin - input_begin, m.text_len);
+    lap(rs, RunStats::Lookup_phase, start);
+    return ok;
+}
 
-            std::string canon_str;
-            if (is_non_iso_hash(m, canon_str)) {
-                if (opt.out_cg)
-                    canon_str = m.cg_to_string("\n", opt.shorten_str);
-                m.print_model(std::cout, canon_str, opt.out_cg);
+size_t
+IsoFilter::process_models_parallel(std::istream& fs, const std::string& check_sym)
+{
+    /* The reader (this thread) splits the input at the "interpretation" lines into batches of
+       model texts, which go through run_pipeline.  Returns the number of models read.
+     */
+    size_t models_count = 0;
+    bool   in_model = false;
+    bool   have_line = false;   // line is the first of the next batch
+
+    std::string line;
+    auto read_batch = [&](std::vector<ModelJob>& batch) {
+        while (have_line || getline(fs, line)) {
+            have_line = false;
+            if (line[0] == '%')
+                continue;
+            if (line.find("interpretation") != std::string::npos) {
+                if (batch.size() == Batch_size) {
+                    have_line = true;
+                    return true;
+                }
+                batch.emplace_back();
+                models_count++;
+                in_model = true;
+            }
+            if (in_model) {
+                batch.back().text.append(line);
+                batch.back().text.append("\n");
             }
         }
+        return false;
+    };
+    run_pipeline(read_batch, check_sym);
+    return models_count;
+}
+
+size_t
+IsoFilter::process_buffer_parallel(const char* pos, const char* end, const std::string& check_sym)
+{
+    /* Same as process_models_parallel, but the batches hold the positions of the models
+       in the buffer [pos, end) instead of copies of their text.
+     */
+    size_t models_count = 0;
+
+    auto read_batch = [&](std::vector<ModelJob>& batch) {
+        while (pos < end) {
+            const char* eol = line_end(pos, end);
+            if (*pos != '%' && find_in_line(pos, eol, Model::Interpretation_label) != eol) {
+                if (!batch.empty())
+                    batch.back().end = pos;
+                if (batch.size() == Batch_size)
+                    return true;   // the next batch starts at this line
+                batch.emplace_back();
+                batch.back().begin = pos;
+                models_count++;
+            }
+            pos = next_line(eol, end);
+        }
+        if (!batch.empty())
+            batch.back().end = end;
+        return false;
+    };
+    run_pipeline(read_batch, check_sym);
+    return models_count;
+}
+
+void
+IsoFilter::run_pipeline(const std::function<bool(std::vector<ModelJob>&)>& read_batch, const std::string& check_sym)
+{
+    /* Reading, canonicalizing and output overlap.  This thread reads the batches (read_batch
+       fills one and returns false at the end of the input) into the todo queue, holding at
+       most Max_batches_per_thread per worker in flight.  Each worker takes a batch, parses
+       its models, looks the exact repeats up in the repeat cache when the batches before it
+       have been (so the first of the repeats is the one canonicalized), canonicalizes the
+       others and hands the batch to the writer thread, which looks the keys up and prints
+       the batches in input order: the first model seen in each isomorphism class is the one
+       printed, as in the single-threaded loop.  If the external dedup fails, the reader
+       stops and the batches in flight are dropped; finish() reports the failure.
+     */
+    struct Batch {
+        size_t                seq;
+        std::vector<ModelJob> jobs;
+    };
+    std::mutex              mutex;
+    std::condition_variable changed;
+    std::deque<std::unique_ptr<Batch>>       todo;   // read, for the workers
+    std::map<size_t, std::unique_ptr<Batch>> done;   // canonicalized, for the writer, by seq
+    size_t num_batches = 0;     // read so far
+    size_t in_flight = 0;       // read and not written yet
+    size_t repeat_turn = 0;     // seq of the batch whose repeats are looked up next
+    bool   reading = true;
+    bool   failed = false;
+
+    auto worker = [&](CanonWorkspace* ws) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            changed.wait(lock, [&] { return !todo.empty() || !reading; });
+            if (todo.empty())
+                return;
+            std::unique_ptr<Batch> batch = std::move(todo.front());
+            todo.pop_front();
+            lock.unlock();
+            for (auto& job : batch->jobs)
+                parse_job(job, check_sym, *ws);
+            if (repeats.is_enabled()) {
+                lock.lock();
+                changed.wait(lock, [&] { return repeat_turn == batch->seq; });
+                lock.unlock();
+                RunStats* rs = phase_stats(*ws);
+                uint64_t start = rs? RunStats::cycles() : 0;
+                for (auto& job : batch->jobs) {
+                    if (repeats.seen(job.raw))
+                        job.model.reset();
+                }
+                lap(rs, RunStats::Lookup_phase, start);
+                lock.lock();
+                ++repeat_turn;
+                changed.notify_all();
+                lock.unlock();
+            }
+            for (auto& job : batch->jobs)
+                canonicalize_job(job, *ws);
+            lock.lock();
+            done[batch->seq] = std::move(batch);
+            changed.notify_all();
+        }
+    };
+    auto writer = [&](CanonWorkspace* ws) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (size_t seq = 0; ; ++seq) {
+            changed.wait(lock, [&] { return done.count(seq) > 0 || (!reading && seq == num_batches); });
+            if (done.count(seq) == 0)
+                return;
+            std::unique_ptr<Batch> batch = std::move(done[seq]);
+            done.erase(seq);
+            const bool skip = failed;
+            lock.unlock();
+            const bool ok = skip || output_batch(batch->jobs, *ws);
+            batch.reset();
+            lock.lock();
+            failed = failed || !ok;
+            --in_flight;
+            changed.notify_all();
+        }
+    };
+
+    workspace(opt.num_threads);   // the writer's, the others are the workers'
+    std::vector<std::thread> threads;
+    for (int t = 0; t < opt.num_threads; ++t)
+        threads.emplace_back(worker, workspaces[t].get());
+    threads.emplace_back(writer, workspaces[opt.num_threads].get());
+
+    for (bool more = true; more; ) {
+        std::unique_ptr<Batch> batch(new Batch());
+        batch->jobs.reserve(Batch_size);
+        more = read_batch(batch->jobs);
+        if (batch->jobs.empty())
+            break;
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return in_flight < Max_batches_per_thread * opt.num_threads || failed; });
+        if (failed)
+            break;
+        batch->seq = num_batches++;
+        ++in_flight;
+        todo.push_back(std::move(batch));
+        changed.notify_all();
     }
-    if (!use_std)
-        filep.close();
-    double total_cpu_time = read_cpu_time() - start_cpu_time;
-    unsigned elapsed_time = read_wall_clock() - start_wall_clock;
-    std::cout << "% Number of models processed: " << models_count << std::endl;
-    std::cout << "% Number of non-iso models: " << non_iso_hash.size() << std::endl;
-    std::cout << "% Total CPU time: " << total_cpu_time << " seconds." << std::endl;
-    std::cout << "% Elapsed time: " << elapsed_time << " seconds." << std::endl;
-    return 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reading = false;
+        changed.notify_all();
+    }
+    for (auto& t : threads)
+        t.join();
+}
+
+CanonWorkspace&
+IsoFilter::workspace(size_t idx)
+{
+    // the workspaces are made on first use, set up from the options
+    while (workspaces.size() <= idx) {
+        workspaces.emplace_back(new CanonWorkspace());
+        workspaces.back()->refine_cells = opt.refine;
+        workspaces.back()->anti_iso = opt.anti_iso;
+        workspaces.back()->collect_stats = !opt.stats.empty() || !opt.hardest.empty();
+        workspaces.back()->set_invariant(opt.invariant, opt.invararg, opt.mininvarlevel, opt.maxinvarlevel);
+        workspaces.back()->set_engine(opt.engine);
+    }
+    return *workspaces[idx];
+}
+
+bool
+IsoFilter::is_repeat(const Model& m)
+{
+    // an exact repeat of a recent model is in the same class and not printed
+    if (!repeats.is_enabled())
+        return false;
+    m.raw_tables(raw);
+    return repeats.seen(raw);
+}
+
+void
+IsoFilter::parse_job(ModelJob& job, const std::string& check_sym, CanonWorkspace& ws) const
+{
+    RunStats* rs = phase_stats(ws);
+    uint64_t start = rs? RunStats::cycles() : 0;
+    const char* pos = job.begin;
+    const char* end = job.end;
+    if (pos == nullptr) {
+        pos = job.text.data();
+        end = pos + job.text.size();
+    }
+    job.model.reset(new Model());
+    job.model->parse_model(pos, end, check_sym);
+    if (repeats.is_enabled())
+        job.model->raw_tables(job.raw);
+    lap(rs, RunStats::Parse_phase, start);
+}
+
+void
+IsoFilter::canonicalize_job(ModelJob& job, CanonWorkspace& ws) const
+{
+    if (!job.model)   // exact repeat
+        return;
+    Model& m = *job.model;
+    RunStats* rs = phase_stats(ws);
+    uint64_t start = rs? RunStats::cycles() : 0;
+    ws.model_search = SearchCost();
+    job.has_graph = m.build_graph(ws, opt.out_cg);
+    if (job.has_graph) {   // not an empty graph
+        lap(rs, RunStats::Graph_phase, start);
+        job.cost = ws.model_search;
+        m.canonical_key(job.key);
+        lap(rs, RunStats::Key_phase, start);
+        if (opt.out_cg)
+            job.cg_str = m.cg_to_string("\n", opt.shorten_str);
+        job.text_len = m.text_len;
+    }
+    job.model.reset();
+}
+
+bool
+IsoFilter::output_batch(std::vector<ModelJob>& batch, CanonWorkspace& ws)
+{
+    /* Returns false if the external dedup failed.  The phases are counted in ws. */
+    RunStats* rs = phase_stats(ws);
+    uint64_t start = rs? RunStats::cycles() : 0;
+    for (auto& job : batch) {
+        if (job.has_graph && hardest.is_enabled())
+            hardest.add(job.cost, job.begin != nullptr? job.begin : job.text.data(), job.text_len);
+        if (job.has_graph && external.is_open()) {
+            if ((!index.is_open() || !index.contains(job.key)) &&
+                !external.add(job.key, job.begin - input_begin, job.text_len))
+                return false;
+            lap(rs, RunStats::Lookup_phase, start);
+        }
+        else if (job.has_graph && is_non_iso_key(job.key)) {
+            lap(rs, RunStats::Lookup_phase, start);
+            std::cout.write(job.begin != nullptr? job.begin : job.text.data(), job.text_len);
+            if (opt.out_cg)
+                std::cout << job.cg_str << std::endl;
+            lap(rs, RunStats::Output_phase, start);
+        }
+        else if (job.has_graph) {
+            lap(rs, RunStats::Lookup_phase, start);
+        }
+    }
+    return true;
+}
+
+void
+IsoFilter::add_hardest(const SearchCost& cost, const Model& m)
+{
+    if (!hardest.is_enabled())
+        return;
+    if (m.text_begin != nullptr)
+        hardest.add(cost, m.text_begin, m.text_len);
+    else
+        hardest.add(cost, m.model_str.data(), m.model_str.size());
+}
+
+bool
+IsoFilter::write_stats(size_t models_count, double cycles_per_second) const
+{
+    // the counters of all the threads, as JSON to opt.stats ("-" for stderr)
+    RunStats total;
+    for (auto& ws : workspaces)
+        total.merge(ws->run_stats);
+    if (opt.stats == "-") {
+        total.print_json(std::cerr, models_count, cycles_per_second);
+        return true;
+    }
+    std::ofstream out(opt.stats);
+    total.print_json(out, models_count, cycles_per_second);
+    if (!out) {
+        std::cerr << "Cannot write the statistics to " << opt.stats << std::endl;
+        return false;
+    }
+    return true;
 }
 
 bool
@@ -88,7 +656,7 @@ IsoFilter::is_non_iso(const Model& model)
         }
     }
     if (non_iso && 
-        (opt.max_cache < 0 || non_iso_hash.size() < opt.max_cache)) {
+        (opt.max_cache < 0 || num_non_iso() < opt.max_cache)) {
         non_iso_vec.push_back(model);
     }
     return non_iso;
@@ -116,18 +684,66 @@ IsoFilter::is_non_iso_hash(const Model& model, std::string& canon_str)
 bool
 IsoFilter::is_non_iso_hash(const Model& model, std::string& canon_str)
 {
+    // canon_str is for the callers that print or keep the string form
     canon_str = model.compress_cms();
-    if (non_iso_hash.find(canon_str) == non_iso_hash.end()) {
-        // std::cerr << "% found non-iso max_cache: " << opt.max_cache << std::endl;   // debug print
-        if (opt.max_cache < 0 || non_iso_hash.size() < opt.max_cache)
-            non_iso_hash.insert(canon_str);
-        // std::cout << "% found non-iso cache size: " << non_iso_hash.size() << std::endl;   // debug print
+    return is_non_iso_hash(model);
+}
+
+bool
+IsoFilter::is_non_iso_hash(const Model& model)
+{
+    model.canonical_key(key);
+    return is_non_iso_key(key);
+}
+
+bool
+IsoFilter::is_non_iso_key(const CanonKey& key)
+{
+    if (opt.fingerprint) {
+        uint64_t lo, hi;
+        key.fingerprint(lo, hi);
+        bool is_new, stored = false;
+        if (opt.max_cache < 0 || non_iso_fps.size() < opt.max_cache)
+            is_new = stored = non_iso_fps.insert(lo, hi);
+        else
+            is_new = !non_iso_fps.contains(lo, hi);
+        // the key kept for a new fingerprint, and the keys that hit one, for the check
+        if (fp_check.is_open() && (stored || !is_new))
+            fp_check.add(lo, hi, key, stored);
+        return is_new;
+    }
+    if (!opt.query_index.empty()) {     // read-only: nothing is added
+        if (index.contains(key))
+            return false;
+        num_new++;
         return true;
     }
-    return false;
+    if (index.is_open() && index.contains(key))   // seen in an earlier run
+        return false;
+    if (opt.max_cache < 0 || non_iso_hash.size() < opt.max_cache)
+        return non_iso_hash.insert(key);
+    // std::cerr << "% cache full, max_cache: " << opt.max_cache << std::endl;   // debug print
+    return !non_iso_hash.contains(key);
 }
 
 
+bool
+IsoFilter::save_index()
+{
+    /* Writes the loaded keys and the keys of the non-isomorphic models found in this run
+       to opt.save_index.  Returns true if success, false otherwise.
+     */
+    std::vector<KeyIndex::Entry> entries;
+    entries.reserve(index.size() + non_iso_hash.size());
+    index.for_each([&entries](uint64_t hash, const uint64_t* words, size_t len) {
+        entries.push_back({hash, words, len});
+    });
+    non_iso_hash.for_each([&entries](const uint64_t* words, size_t len) {
+        entries.push_back({CanonKey::hash_words(words, len), words, len});
+    });
+    return KeyIndex::save(opt.save_index, workspace(0).key_form(), entries);
+}
+
 size_t
 IsoFilter::get_branch_key(const std::string& canon_str)
 {
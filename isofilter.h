@@ -17,7 +17,15 @@
 #include <fstream>
 // #include <zlib.h>
 #include <ext/pb_ds/assoc_container.hpp>
+#include "canon_workspace.h"
+#include "canon_key.h"
+#include "external_dedup.h"
+#include "fingerprint_set.h"
+#include "hardest_models.h"
+#include "key_index.h"
+#include "key_set.h"
 #include "model.h"
+#include "repeat_cache.h"
 
 struct Options {
     bool        out_cg;
@@ -27,29 +35,109 @@ struct Options {
     std::string file_name;
     std::string check_sym;
     bool        test;
-
-    Options() : out_cg(false), compress(false), max_cache(-1), shorten_str(false), test(false) {};
+    int         num_threads;
+    bool        use_mmap;
+    bool        fingerprint;     // keep only 128-bit fingerprints of the canonical keys
+    std::string verify_dir;      // if set, spill the full keys there and count fingerprint collisions
+    size_t      mem_budget;      // in MB; if not 0, dedup with sorted runs on disk in spill_dir
+    std::string spill_dir;
+    std::string load_index;      // keys of the models seen in earlier runs
+    std::string save_index;      // where to write those keys and the new ones at the end
+    std::string query_index;     // only print the models whose keys are not in this index
+    bool        lazy;            // canonicalize only the models whose invariants an earlier model had
+    bool        refine;          // split the initial colouring by element invariants
+    bool        anti_iso;        // models anti-isomorphic to an earlier one are duplicates too
+    std::string invariant;       // nauty vertex invariant, see CanonWorkspace::set_invariant
+    int         invararg;
+    int         mininvarlevel;
+    int         maxinvarlevel;
+    std::string engine;          // canonizer, see CanonWorkspace::set_engine
+    size_t      repeat_cache;    // in MB; bound of the cache of raw tables that skips exact repeats, 0: off
+    std::string stats;           // if set, per-phase cycles and nauty statistics are written there as JSON
+    std::string hardest;         // if set, the models with the costliest nauty searches are written there
+    size_t      hardest_count;   // how many of them, by canonizer cycles and by search-tree nodes
+
+    Options() : out_cg(false), compress(false), max_cache(-1), shorten_str(false), test(false), num_threads(1),
+                use_mmap(false), fingerprint(false), mem_budget(0), spill_dir("/tmp"),
+                lazy(false), refine(false), anti_iso(false), invariant("adjacencies"), invararg(0), mininvarlevel(0),
+                maxinvarlevel(999), engine("auto"), repeat_cache(16),
+                hardest_count(20) {};
 };
 
 
 class IsoFilter {
 private:
     std::vector<Model>               non_iso_vec;     // copy and assignment constructors for Model are needed if this vector is to be used
-    std::unordered_set<std::string>  non_iso_hash;
+    KeySet                           non_iso_hash;
+    FingerprintSet                   non_iso_fps;     // used instead of non_iso_hash with opt.fingerprint
+    CollisionCheck                   fp_check;
+    ExternalDedup                    external;        // used instead of non_iso_hash with opt.mem_budget
+    const char*                      input_begin;     // the mapped input, for the model offsets
+    size_t                           num_new;         // models not in the index, with opt.query_index
+    KeyIndex                         index;           // keys loaded with opt.load_index or opt.query_index
+    // invariant hash -> text of the only model seen with it, not canonicalized yet ("" once it is)
+    std::unordered_map<uint64_t, std::string>  lazy_buckets;
+    bool                             use_lazy;
+    size_t                           num_lazy_pending;  // models in lazy_buckets not canonicalized yet
+    RepeatCache                      repeats;         // raw tables of the recent models
+    std::string                      raw;             // reused by is_repeat
+    HardestModels                    hardest;         // with opt.hardest
     Options opt;
     size_t branch_key;
     __gnu_pbds::gp_hash_table<std::string, size_t> non_iso_hash_table;
+    std::vector<std::unique_ptr<CanonWorkspace>>    workspaces;   // one per worker thread
+    CanonKey key;                                                   // reused by is_non_iso_hash
+    static const size_t Batch_size = 256;            // models per batch of the parallel pipeline
+    static const size_t Max_batches_per_thread = 4;  // batches in flight per worker thread
+
+    // one model as split off the input by the reader, and the results of the workers.
+    // The model is either the copy in text, or [begin, end) of a mapped input.
+    // The parser sets text_len to the length of the model text from begin (or text.data()),
+    // and only that range is written out if the model turns out to be non-isomorphic.
+    struct ModelJob {
+        std::string text;
+        const char* begin;
+        const char* end;
+        size_t      text_len;
+        CanonKey    key;
+        std::string cg_str;
+        bool        has_graph;
+        std::unique_ptr<Model> model;   // between parsing and canonicalization
+        std::string raw;                // its raw tables, with the repeat cache
+        SearchCost  cost;               // of its nauty calls, with opt.hardest
+
+        ModelJob() : begin(nullptr), end(nullptr), text_len(0), has_graph(false) {};
+    };
 
 private:
     size_t get_branch_key(const std::string& canon_str);
+    size_t process_models(std::istream& fs, const std::string& check_sym);
+    size_t process_buffer(const char* pos, const char* end, const std::string& check_sym);
+    size_t process_models_parallel(std::istream& fs, const std::string& check_sym);
+    size_t process_buffer_parallel(const char* pos, const char* end, const std::string& check_sym);
+    void   output_if_non_iso(Model& m);
+    bool   spill_model(Model& m);
+    bool   output_if_first_of_invariant(Model& m, const std::string& check_sym);
+    bool   save_index();
+    CanonWorkspace& workspace(size_t idx);
+    void   run_pipeline(const std::function<bool(std::vector<ModelJob>&)>& read_batch, const std::string& check_sym);
+    void   parse_job(ModelJob& job, const std::string& check_sym, CanonWorkspace& ws) const;
+    void   canonicalize_job(ModelJob& job, CanonWorkspace& ws) const;
+    bool   is_repeat(const Model& m);
+    RunStats* phase_stats(CanonWorkspace& ws) const { return opt.stats.empty()? nullptr : &ws.run_stats; };
+    bool   write_stats(size_t models_count, double cycles_per_second) const;
+    void   add_hardest(const SearchCost& cost, const Model& m);
+    bool   output_batch(std::vector<ModelJob>& batch, CanonWorkspace& ws);
+    size_t num_non_iso() const { return (opt.fingerprint? non_iso_fps.size() : non_iso_hash.size()) + num_lazy_pending; };
 
 public:
     double  start_time;       // in micro sec
     double  start_cpu_time;   // in micro sec
 
 public:
-    IsoFilter(const Options& opt) : opt(opt), branch_key(0) {};
-    IsoFilter() {};
+    IsoFilter(const Options& opt) : input_begin(nullptr), num_new(0), use_lazy(false), num_lazy_pending(0),
+                                     opt(opt), branch_key(0) {};
+    IsoFilter() : input_begin(nullptr), num_new(0), use_lazy(false), num_lazy_pending(0), branch_key(0) {};
 
     void set_options(Options& in_opt) { opt=in_opt; };
 
@@ -57,6 +145,8 @@ public:
 
     bool is_non_iso(const Model&);    // for debugging only
     bool is_non_iso_hash(const Model&, std::string&);
+    bool is_non_iso_hash(const Model&);
+    bool is_non_iso_key(const CanonKey& key);
 
     static double read_cpu_time() {
         struct rusage ru;
@@ -68,7 +158,7 @@ public:
         return (unsigned) t;
     }
     bool is_non_isomorphic(Model& m, std::string& shortened_str);
-    bool cache_exceeded() const { return opt.max_cache >= 0 && non_iso_hash.size() >= opt.max_cache; }
+    bool cache_exceeded() const { return opt.max_cache >= 0 && num_non_iso() >= opt.max_cache; }
     // std::string compress(const std::string& str, int compressionlevel = Z_BEST_COMPRESSION);
 
     bool IsomorphicAlgebras(const Model& model1, const Model& model2) const;
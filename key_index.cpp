@@ -0,0 +1,137 @@
+/* key_index.cpp
+ */
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include "key_index.h"
+
+const uint64_t KeyIndex::Magic;
+const uint64_t KeyIndex::Version;
+const size_t   KeyIndex::Header_words;
+const int      KeyIndex::Max_interpolation_steps;
+const size_t   KeyIndex::Min_interpolation_range;
+
+bool
+KeyIndex::open(const std::string& file_name, uint64_t key_form)
+{
+    /* Opens the index if its keys were made with key_form.
+       Returns true if success, false otherwise (with a message on std::cerr).
+     */
+    if (!file.open(file_name, false))
+        return false;
+    const uint64_t* header = reinterpret_cast<const uint64_t*>(file.begin());
+    const size_t    file_words = file.length() / sizeof(uint64_t);
+    if (file_words < Header_words || header[0] != Magic) {
+        std::cerr << "KeyIndex: " << file_name << " is not a key index" << std::endl;
+        file.close();
+        return false;
+    }
+    if (header[1] != Version) {
+        std::cerr << "KeyIndex: " << file_name << " has version " << header[1] << ", not " << Version
+                  << "; rebuild it" << std::endl;
+        file.close();
+        return false;
+    }
+    if (file_words != Header_words + 2 * header[3] + header[4]) {
+        std::cerr << "KeyIndex: " << file_name << " is truncated" << std::endl;
+        file.close();
+        return false;
+    }
+    if (header[2] != key_form) {
+        std::cerr << "KeyIndex: " << file_name << " was made with other canonical-form options "
+                  << "(--engine, --invariant and its levels, --refine, --anti-iso)" << std::endl;
+        file.close();
+        return false;
+    }
+    num_keys = header[3];
+    hashes = header + Header_words;
+    offsets = hashes + num_keys;
+    data = offsets + num_keys;
+    return true;
+}
+
+const uint64_t*
+KeyIndex::lower_bound(uint64_t hash) const
+{
+    /* The hashes are close to uniform, so interpolation finds the range of hash in a few
+       steps (about log log n); the last steps, or a skewed range, use binary search.
+     */
+    size_t lo = 0;
+    size_t hi = num_keys;
+    for (int step = 0; step < Max_interpolation_steps && hi - lo > Min_interpolation_range; ++step) {
+        const uint64_t lo_hash = hashes[lo];
+        const uint64_t hi_hash = hashes[hi - 1];
+        if (hash <= lo_hash)
+            return hashes + lo;
+        if (hash > hi_hash)
+            return hashes + hi;
+        const size_t pos = lo + size_t((unsigned __int128)(hash - lo_hash) * (hi - 1 - lo) / (hi_hash - lo_hash));
+        if (hashes[pos] < hash)
+            lo = pos + 1;
+        else
+            hi = pos + 1;     // hashes[pos] >= hash, so the bound is at most pos
+    }
+    return std::lower_bound(hashes + lo, hashes + hi, hash);
+}
+
+bool
+KeyIndex::contains(const CanonKey& key) const
+{
+    const uint64_t  hash = key.hash();
+    const uint64_t* first = lower_bound(hash);
+    for (const uint64_t* h = first; h < hashes + num_keys && *h == hash; ++h) {
+        const uint64_t* stored = data + offsets[h - hashes];
+        if (stored[0] == key.size() && memcmp(stored + 1, key.data(), key.size() * sizeof(uint64_t)) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool
+KeyIndex::save(const std::string& file_name, uint64_t key_form, std::vector<Entry>& entries)
+{
+    /* Writes the keys sorted by hash to a temporary file renamed to file_name at the end,
+       so readers never see a partial index.
+       Returns true if success, false otherwise (with a message on std::cerr).
+     */
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        if (a.hash != b.hash)
+            return a.hash < b.hash;
+        if (a.len != b.len)
+            return a.len < b.len;
+        return memcmp(a.words, b.words, a.len * sizeof(uint64_t)) < 0;
+    });
+    uint64_t data_words = 0;
+    std::vector<uint64_t> offsets;
+    offsets.reserve(entries.size());
+    for (auto& e : entries) {
+        offsets.push_back(data_words);
+        data_words += 1 + e.len;
+    }
+
+    const std::string tmp_name = file_name + ".tmp";
+    std::ofstream out(tmp_name.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "KeyIndex: cannot create " << tmp_name << std::endl;
+        return false;
+    }
+    uint64_t header[Header_words] = {Magic, Version, key_form, entries.size(), data_words};
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    for (auto& e : entries)
+        out.write(reinterpret_cast<const char*>(&e.hash), sizeof(uint64_t));
+    out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    for (auto& e : entries) {
+        uint64_t len = e.len;
+        out.write(reinterpret_cast<const char*>(&len), sizeof(uint64_t));
+        out.write(reinterpret_cast<const char*>(e.words), e.len * sizeof(uint64_t));
+    }
+    out.close();
+    if (!out || std::rename(tmp_name.c_str(), file_name.c_str()) != 0) {
+        std::cerr << "KeyIndex: cannot write " << file_name << std::endl;
+        std::remove(tmp_name.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,72 @@
+/* key_index.h : on-disk index of canonical keys. */
+/* Version 1.1, July 2023. */
+
+#ifndef KEY_INDEX_H
+#define KEY_INDEX_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "canon_key.h"
+#include "mapped_file.h"
+
+/*  An immutable set of canonical keys in a file that is used memory-mapped, as is.
+    Layout, all in 64-bit words:
+        header      Magic, Version, key form, number of keys n, number of data words
+        hashes[n]   the key hashes, in ascending order
+        offsets[n]  position in data of the key with hashes[i]
+        data        each key as its length in words followed by its words
+    The key form (CanonWorkspace::key_form) identifies the options the keys were made with;
+    an index is only opened by a run with the same options.
+    A lookup searches the hash (interpolation, then binary search), then compares the keys
+    that have it.  The file is mapped read-only and shared, so processes querying the same
+    index share its pages in the page cache.
+ */
+class KeyIndex {
+public:
+    static const uint64_t Magic = 0x315844494E4F5349ULL;    // "ISONIDX1"
+    static const uint64_t Version = 3;     // 3: -c no longer changes the keys of the auto engine
+    static const size_t   Header_words = 5;
+
+    // a key to be saved, which must stay valid until save() returns
+    struct Entry {
+        uint64_t        hash;
+        const uint64_t* words;
+        size_t          len;
+    };
+
+private:
+    static const int    Max_interpolation_steps = 4;
+    static const size_t Min_interpolation_range = 16;
+
+    MappedFile      file;
+    const uint64_t* hashes;
+    const uint64_t* offsets;
+    const uint64_t* data;
+    size_t          num_keys;
+
+private:
+    const uint64_t* lower_bound(uint64_t hash) const;   // first of hashes >= hash
+
+public:
+    KeyIndex() : hashes(nullptr), offsets(nullptr), data(nullptr), num_keys(0) {};
+
+    bool   open(const std::string& file_name, uint64_t key_form);
+    bool   is_open() const { return hashes != nullptr; };
+    size_t size() const { return num_keys; };
+    bool   contains(const CanonKey& key) const;
+
+    // calls f(hash, words, len) for each key, in index order
+    template <class F> void for_each(F f) const {
+        for (size_t idx = 0; idx < num_keys; ++idx) {
+            const uint64_t* stored = data + offsets[idx];
+            f(hashes[idx], stored + 1, size_t(stored[0]));
+        }
+    };
+
+    static bool save(const std::string& file_name, uint64_t key_form, std::vector<Entry>& entries);
+};
+
+#endif
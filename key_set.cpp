@@ -0,0 +1,142 @@
+/* key_set.cpp
+ */
+#include <cstring>
+#include <algorithm>
+#include "key_set.h"
+
+const size_t KeySet::Block_words;
+const size_t KeySet::Min_capacity;
+
+KeySet::KeySet()
+    : num_keys(0), arena_words(0), block_used(0), num_lookups(0), total_probes(0), max_probes(0)
+{
+}
+
+void
+KeySet::clear()
+{
+    slots.clear();
+    blocks.clear();
+    num_keys = 0;
+    arena_words = 0;
+    block_used = 0;
+}
+
+bool
+KeySet::find_slot(const uint64_t* words, size_t len, uint64_t hash, size_t& slot) const
+{
+    /* Linear probing from the home slot of hash.  Returns true with slot at the key if
+       found, false with slot at the empty slot where it would go otherwise.
+     */
+    const size_t   mask = slots.size() - 1;
+    const uint64_t tag = tag_of(hash);
+    size_t probes = 1;
+    for (slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask, ++probes) {
+        if ((slots[slot] & ~Pos_mask) != tag)
+            continue;
+        const uint64_t* stored = key_at((slots[slot] & Pos_mask) - 1);
+        if (stored[0] == len && memcmp(stored + 1, words, len * sizeof(uint64_t)) == 0)
+            break;
+    }
+    num_lookups++;
+    total_probes += probes;
+    if (probes > max_probes)
+        max_probes = probes;
+    return slots[slot] != 0;
+}
+
+uint64_t
+KeySet::store(const uint64_t* words, size_t len)
+{
+    /* Appends [len, words...] to the arena and returns its position, which is the block
+       number * Block_words + the offset in the block.  A key never spans two blocks; an
+       oversized key gets a block of its own.
+     */
+    if (blocks.empty() || block_used + len + 1 > Block_words) {
+        blocks.emplace_back(std::max(Block_words, len + 1));
+        arena_words += blocks.back().size();
+        block_used = 0;
+    }
+    uint64_t pos = (blocks.size() - 1) * Block_words + block_used;
+    uint64_t* dest = blocks.back().data() + block_used;
+    dest[0] = len;
+    memcpy(dest + 1, words, len * sizeof(uint64_t));
+    block_used += len + 1;
+    return pos;
+}
+
+void
+KeySet::grow()
+{
+    std::vector<uint64_t> old_slots(std::max(Min_capacity, 2 * slots.size()), 0);
+    old_slots.swap(slots);
+    const size_t mask = slots.size() - 1;
+    for (auto entry : old_slots) {
+        if (entry == 0)
+            continue;
+        const uint64_t* stored = key_at((entry & Pos_mask) - 1);
+        size_t slot = CanonKey::hash_words(stored + 1, stored[0]) & mask;
+        while (slots[slot] != 0)
+            slot = (slot + 1) & mask;
+        slots[slot] = entry;
+    }
+}
+
+bool
+KeySet::contains(const CanonKey& key) const
+{
+    size_t slot;
+    return !slots.empty() && find_slot(key.data(), key.size(), key.hash(), slot);
+}
+
+bool
+KeySet::insert(const CanonKey& key)
+{
+    return insert(key.data(), key.size(), key.hash());
+}
+
+bool
+KeySet::insert(const uint64_t* words, size_t len, uint64_t hash)
+{
+    // keeps the load factor at most 0.7
+    if (10 * (num_keys + 1) > 7 * slots.size())
+        grow();
+    size_t slot;
+    if (find_slot(words, len, hash, slot))
+        return false;
+    slots[slot] = tag_of(hash) | (store(words, len) + 1);
+    num_keys++;
+    return true;
+}
+
+void
+KeySet::displacement_stats(double& mean, size_t& max) const
+{
+    // distance of each stored key from its home slot
+    const size_t mask = slots.size() - 1;
+    size_t total = 0;
+    max = 0;
+    for (size_t slot = 0; slot < slots.size(); ++slot) {
+        if (slots[slot] == 0)
+            continue;
+        const uint64_t* stored = key_at((slots[slot] & Pos_mask) - 1);
+        size_t home = CanonKey::hash_words(stored + 1, stored[0]) & mask;
+        size_t dist = (slot - home) & mask;
+        total += dist;
+        if (dist > max)
+            max = dist;
+    }
+    mean = num_keys? double(total) / num_keys : 0.0;
+}
+
+void
+KeySet::print_stats(std::ostream& os) const
+{
+    double mean_disp;
+    size_t max_disp;
+    displacement_stats(mean_disp, max_disp);
+    os << "% Key set: " << num_keys << " keys in " << capacity() << " slots, load factor " << load_factor()
+       << ", " << memory_bytes() / 1000000.0 << " MB" << std::endl;
+    os << "% Key set probes: mean " << mean_probes() << " per lookup, max " << max_probe_length()
+       << "; displacement mean " << mean_disp << ", max " << max_disp << std::endl;
+}
@@ -0,0 +1,74 @@
+/* key_set.h : open-addressing set of canonical keys. */
+/* Version 1.1, July 2023. */
+
+#ifndef KEY_SET_H
+#define KEY_SET_H
+
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+#include "canon_key.h"
+
+/*  A set of CanonKeys without per-key allocations.  The keys are stored one after the
+    other, each as its length in words followed by its words, in large blocks (the arena).
+    The table is an array of 64-bit slots with linear probing: a slot holds the arena
+    position of its key plus one (0 for an empty slot) in the low bits, and the high bits
+    of the key hash as a tag, so most mismatches are rejected without touching the arena.
+ */
+class KeySet {
+private:
+    static const unsigned Pos_bits = 40;
+    static const uint64_t Pos_mask = (uint64_t(1) << Pos_bits) - 1;
+    static const size_t   Block_words = size_t(1) << 16;
+    static const size_t   Min_capacity = 1024;
+
+    std::vector<uint64_t>               slots;
+    std::vector<std::vector<uint64_t>>  blocks;
+    size_t                              num_keys;
+    size_t                              arena_words;   // words allocated in all blocks
+    size_t                              block_used;    // words used in the last block
+
+    // lookup statistics
+    mutable size_t num_lookups;
+    mutable size_t total_probes;
+    mutable size_t max_probes;
+
+private:
+    static uint64_t tag_of(uint64_t hash) { return hash >> Pos_bits << Pos_bits; };
+    const uint64_t* key_at(uint64_t pos) const { return blocks[pos / Block_words].data() + pos % Block_words; };
+    bool   find_slot(const uint64_t* words, size_t len, uint64_t hash, size_t& slot) const;
+    uint64_t store(const uint64_t* words, size_t len);
+    void   grow();
+
+public:
+    KeySet();
+
+    bool   contains(const CanonKey& key) const;
+    bool   insert(const CanonKey& key);       // true if the key was not in the set
+    bool   insert(const uint64_t* words, size_t len, uint64_t hash);
+    void   clear();
+
+    size_t size() const { return num_keys; };
+    size_t capacity() const { return slots.size(); };
+    double load_factor() const { return slots.empty()? 0.0 : double(num_keys) / slots.size(); };
+    size_t memory_bytes() const { return (slots.size() + arena_words) * sizeof(uint64_t); };
+    double mean_probes() const { return num_lookups? double(total_probes) / num_lookups : 0.0; };
+    size_t max_probe_length() const { return max_probes; };
+    void   displacement_stats(double& mean, size_t& max) const;
+
+    // calls f(words, len) for each key, in table order
+    template <class F> void for_each(F f) const {
+        for (uint64_t slot : slots) {
+            if (slot != 0) {
+                const uint64_t* stored = key_at((slot & Pos_mask) - 1);
+                f(stored + 1, size_t(stored[0]));
+            }
+        }
+    };
+
+    void   print_stats(std::ostream& os) const;
+};
+
+#endif
@@ -29,19 +29,41 @@ main(int argc, char *argv[])
     app.add_flag("-x", opt.compress, "compress the canonical graph string")->default_val(false);
     app.add_flag("-s", opt.shorten_str, "shortend canonical graph string")->default_val(false);
     app.add_flag("-t", opt.test, "run isomorphismAlgebras")->default_val(false);
+    app.add_option("-j", opt.num_threads, "number of worker threads")->default_val(1);
+    app.add_flag("--mmap", opt.use_mmap, "memory-map the input file and parse it in place")->default_val(false);
+    app.add_flag("--fingerprint", opt.fingerprint, "keep only 128-bit fingerprints of the canonical forms")->default_val(false);
+    app.add_option("--verify", opt.verify_dir, "with --fingerprint, spill the canonical forms into this directory and count fingerprint collisions");
+    app.add_option("--mem-budget", opt.mem_budget, "memory budget in MB for dedup with sorted runs on disk (0: in memory)")->default_val(0);
+    app.add_flag("--lazy", opt.lazy, "canonicalize a model only when an earlier model has the same invariants")->default_val(false);
+    app.add_flag("--refine", opt.refine, "split the initial colouring given to nauty by element invariants")->default_val(false);
+    app.add_flag("--anti-iso", opt.anti_iso, "also filter out models anti-isomorphic to an earlier one (binary tables transposed)")->default_val(false);
+    app.add_option("--engine", opt.engine, "canonizer: nauty, dense (densenauty), traces, direct (search the relabellings of the tables) or auto")->default_val("auto");
+    app.add_option("--invariant", opt.invariant, "nauty vertex invariant: adjacencies, distances, isonaut or none")->default_val("adjacencies");
+    app.add_option("--invararg", opt.invararg, "argument of the vertex invariant")->default_val(0);
+    app.add_option("--mininvarlevel", opt.mininvarlevel, "first search-tree level where the invariant is used")->default_val(0);
+    app.add_option("--maxinvarlevel", opt.maxinvarlevel, "last search-tree level where the invariant is used")->default_val(999);
+    app.add_option("--repeat-cache", opt.repeat_cache, "memory in MB for the raw tables of recent models, to skip exact repeats (0: off)")->default_val(16);
+    app.add_option("--stats", opt.stats, "write per-phase cycle counts and nauty search statistics as JSON to this file (- for stderr)");
+    app.add_option("--hardest", opt.hardest, "write the models with the costliest canonical labellings to this file, with their costs");
+    app.add_option("--hardest-count", opt.hardest_count, "number of models kept by canonizer time and by search-tree nodes for --hardest")->default_val(20);
+    app.add_option("--load-index", opt.load_index, "skip the models whose canonical forms are in this index file");
+    app.add_option("--save-index", opt.save_index, "write the canonical forms seen (loaded and new) to this index file");
+    app.add_option("--query", opt.query_index, "only print the models whose canonical forms are not in this index file, without filtering them among themselves");
+    app.add_option("--spill-dir", opt.spill_dir, "directory for the sorted runs of --mem-budget")->default_val("/tmp");
 
     CLI11_PARSE(app, argc, argv);
 
     IsoFilter filter(opt);
+    int status = 0;
     if (opt.test)
         filter.Test_IsomorphismAlgebras();
     else
-        filter.process_all_models();
+        status = filter.process_all_models();
 
   struct rusage usage;
   int ret = getrusage(RUSAGE_THREAD, &usage);
 
   std::cerr << "\nMaximum resident size: " << usage.ru_maxrss/1000000.0 << " GB" << std::endl;
 
-    exit(0);
+    return status;
 }
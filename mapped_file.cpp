@@ -0,0 +1,49 @@
+/* mapped_file.cpp
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include "mapped_file.h"
+
+bool
+MappedFile::open(const std::string& file_name, bool sequential)
+{
+    /* Returns true if success, false otherwise (with a message on std::cerr). */
+    close();
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "MappedFile: cannot open " << file_name << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        std::cerr << "MappedFile: cannot stat " << file_name << std::endl;
+        ::close(fd);
+        return false;
+    }
+    size = st.st_size;
+    if (size > 0) {
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            std::cerr << "MappedFile: cannot map " << file_name << std::endl;
+            ::close(fd);
+            size = 0;
+            return false;
+        }
+        madvise(p, size, sequential? MADV_SEQUENTIAL : MADV_RANDOM);
+        data = static_cast<const char*>(p);
+    }
+    ::close(fd);
+    return true;
+}
+
+void
+MappedFile::close()
+{
+    if (data != nullptr)
+        munmap(const_cast<char*>(data), size);
+    data = nullptr;
+    size = 0;
+}
@@ -0,0 +1,52 @@
+/* mapped_file.h : read-only memory-mapped input files. */
+/* Version 1.1, July 2023. */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+/*  Maps a whole file into memory so the models can be scanned in place.
+    Helpers below walk the buffer line by line without copying.
+ */
+class MappedFile {
+private:
+    const char* data;
+    size_t      size;
+
+public:
+    MappedFile() : data(nullptr), size(0) {};
+    ~MappedFile() { close(); };
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& file_name, bool sequential = true);
+    void close();
+
+    const char* begin() const { return data; };
+    const char* end() const { return data + size; };
+    size_t      length() const { return size; };
+};
+
+// end of the line starting at p: the position of its '\n', or end
+inline const char* line_end(const char* p, const char* end)
+{
+    const void* nl = memchr(p, '\n', end - p);
+    return nl == nullptr ? end : static_cast<const char*>(nl);
+}
+
+// start of the line after the one ending at eol
+inline const char* next_line(const char* eol, const char* end)
+{
+    return eol < end ? eol + 1 : end;
+}
+
+// first occurrence of pat in [b, e), or e if none
+inline const char* find_in_line(const char* b, const char* e, const std::string& pat)
+{
+    return std::search(b, e, pat.begin(), pat.end());
+}
+
+#endif
@@ -3,6 +3,9 @@
 #include <sstream>
 #include <iostream>
 #include "nauty_utils.h"
+#include "canon_workspace.h"
+#include "mapped_file.h"
+#include "canon_key.h"
 #include "model.h"
 
 /*
@@ -28,6 +31,7 @@ const std::string Model::Relation_label = "relation";
 const std::string Model::Function_arity_label = "_";
 const std::string Model::Function_unary_label = "(_)";
 const std::string Model::Function_binary_label = "(_,_)";
+const std::string Model::Function_ternary_label = "(_,_,_)";
 const std::string Model::Function_stopper = "])";
 const std::string Model::Model_stopper = "]).";
 
@@ -50,10 +54,28 @@ Model::Model(size_t odr, std::vector<int>& constants,
              std::vector<std::vector<std::vector<int>>>& in_bin_ops,
              std::vector<std::vector<std::vector<int>>>& in_bin_rels,
              bool save_cg) 
-       : order(odr), constants(constants), bin_ops(in_bin_ops), un_ops(in_un_ops), bin_rels(in_bin_rels), 
-         el_fixed_width(1), cg(nullptr), num_unassigned(0), save_cg(save_cg) 
+       : constants(constants), num_unassigned(0), order(odr),
+         el_fixed_width(1), cg(nullptr), text_begin(nullptr), text_len(0), save_cg(save_cg),
+         transposed(false)
 {
     set_width(odr);
+    for (auto& op : in_un_ops) {
+        size_t pos = tables.add_table(order);
+        un_ops.push_back(pos);
+        store_row(op, pos, pos + order);
+    }
+    for (auto& op : in_bin_ops) {
+        size_t pos = tables.add_table(order * order);
+        bin_ops.push_back(pos);
+        for (auto& row : op)
+            store_row(row, pos, bin_ops.back() + order * order);
+    }
+    for (auto& op : in_bin_rels) {
+        size_t pos = tables.add_table(order * order);
+        bin_rels.push_back(pos);
+        for (auto& row : op)
+            store_row(row, pos, bin_rels.back() + order * order);
+    }
     build_graph(save_cg);
 }
 
@@ -84,11 +106,20 @@ Model::operator==(const Model& a) const
 void
 Model::print_model(std::ostream& os, const std::string& canon_str, bool out_cg) const
 {
-    os << model_str;
+    print_text(os);
     if (out_cg)
         os << canon_str << std::endl;
 }
 
+void
+Model::print_text(std::ostream& os) const
+{
+    if (text_begin != nullptr)
+        os.write(text_begin, text_len);
+    else
+        os << model_str;
+}
+
 std::string
 Model::find_func_name(const std::string& func)
 {
@@ -102,6 +133,7 @@ Model::find_func_name(const std::string& func)
 void
 Model::set_width(size_t order)
 {
+    tables.reset(order);
     size_t base = 64;
     if (order > 64) {
         base *= 64;
@@ -128,8 +160,10 @@ Model::fill_meta_data(const std::string& interp)
 int
 Model::find_arity(const std::string& func)
 {
-    size_t arity = 3;
-    if (func.find(Function_binary_label) != std::string::npos)
+    size_t arity = 4;   // or higher
+    if (func.find(Function_ternary_label) != std::string::npos)
+        arity = 3;
+    else if (func.find(Function_binary_label) != std::string::npos)
         arity = 2;
     else if (func.find(Function_unary_label) != std::string::npos)
         arity = 1;
@@ -180,8 +214,11 @@ Model::parse_model(std::istream& fs, const std::string& check_sym)
             case 1:
                 done = parse_unary(line, ignore_op);
                 break;
-            default:
-                done = parse_bin(fs, is_func, ignore_op);
+            case 2:
+                done = parse_bin(fs, is_func, arity, ignore_op);
+                break;
+            default:   // ternary ops; ternary relations and higher arities are skipped
+                done = parse_bin(fs, is_func, 3, ignore_op || !is_func || arity > 3);
             }
         }
     }
@@ -222,32 +259,50 @@ Model::parse_unary(const std::string& line, bool ignore_op)
     std::string row_str = line.substr(start+1, end - start - 1) + " ";
     std::vector<int> row;
     parse_row(row_str, row);
-    if (!ignore_op)
-        un_ops.push_back(row); 
+    if (!ignore_op) {
+        size_t pos = tables.add_table(order);
+        un_ops.push_back(pos);
+        store_row(row, pos, pos + order);
+    }
 
     return end_of_model;    
 }
 
 bool
-Model::parse_bin(std::istream& fs, bool is_func, bool ignore_op)
+Model::parse_bin(std::istream& fs, bool is_func, size_t arity, bool ignore_op)
 {
-    /* This function parse a 2-d function or relation.
+    /* This function parse a 2-d function or relation, or a ternary function (arity 3),
+       whose order^3 cells come as order^2 rows.
        The "[" token is already seen before coming to this function 
        On return, the line containing "])" tokens will have been removed
-       The binary operation will be pushed to m.bin_ops
+       The operation will be pushed to m.bin_ops (or m.ternary_ops)
        Lines starting with % are comments, and are ignored.
        Returns true if all functions/relations are extracted, false otherwise */
     
     // TODO: add checking for correct # of rows etc
     bool done = false;
     bool end_model = false;
-    std::vector<std::vector<int>>  two_d;
+    size_t pos = 0;
+    size_t table_end = 0;
+    if (!ignore_op) {
+        const size_t num_cells = arity == 3? order * order * order : order * order;
+        pos = tables.add_table(num_cells);
+        table_end = pos + num_cells;
+        if (arity == 3)
+            ternary_ops.push_back(pos);
+        else if (is_func)
+            bin_ops.push_back(pos);
+        else
+            bin_rels.push_back(pos);
+    }
     std::vector<int>  row;
     while (!done && fs) {
         std::string line;
         getline(fs, line);
         if (line[0] == '%')
             continue;
+        model_str.append(line);
+        model_str.append("\n");
         size_t end_pos = line.find(Function_stopper);
         if (end_pos != std::string::npos) {
             done = true;
@@ -255,19 +310,195 @@ Model::parse_bin(std::istream& fs, bool is_func, bool ignore_op)
             if (line.find(Model_stopper) != std::string::npos)
                 end_model = true;
         }
-        model_str.append(line);
-        model_str.append("\n");
 	if (!ignore_op) {
             parse_row(line, row);
-            two_d.push_back(row);
+            store_row(row, pos, table_end);
             row.clear();
 	}
     }
+    return end_model;
+}
+
+void
+Model::store_row(const std::vector<int>& row, size_t& pos, size_t table_end)
+{
+    // copies the row to the table cells from pos on, without running past the table
+    for (auto v : row) {
+        if (pos >= table_end)
+            break;
+        tables.set_cell(pos++, v);
+    }
+}
+
+/*
+  In-place parsing of a model held in a memory buffer (e.g. a MappedFile).
+  Lines are [line, eol) ranges into the buffer and numbers are read digit by digit
+  straight into the tables, so nothing is allocated per line.
+*/
+
+void
+Model::fill_meta_data(const char* line, const char* eol)
+{
+    // interpretation( 3, [number=1, seconds=0], [
+    const char* p = std::find(line, eol, '(');
+    while (p < eol && !isdigit(*p))
+        ++p;
+    order = 0;
+    while (p < eol && isdigit(*p))
+        order = order * 10 + (*p++ - '0');
+    set_width(order);
+}
+
+int
+Model::find_arity(const char* line, const char* eol)
+{
+    size_t arity = 4;   // or higher
+    if (find_in_line(line, eol, Function_ternary_label) != eol)
+        arity = 3;
+    else if (find_in_line(line, eol, Function_binary_label) != eol)
+        arity = 2;
+    else if (find_in_line(line, eol, Function_unary_label) != eol)
+        arity = 1;
+    else if (find_in_line(line, eol, Function_arity_label) == eol)
+        arity = 0;
+    return arity;
+}
+
+bool
+Model::is_checked_sym(const char* line, const char* eol, const std::string& check_sym)
+{
+    /* check_sym is ",sym1,sym2,...,"; true if the op/rel name on the line is in it */
+    const char* start = std::find(line, eol, '(');
+    const char* end = start < eol ? std::find(start+1, eol, '(') : eol;
+    std::string name(start < eol ? start+1 : eol, end);
+    op_symbols.push_back(name);
+    if (check_sym.empty())
+        return true;
+    size_t len = name.size();
+    for (size_t pos = check_sym.find(name); pos != std::string::npos; pos = check_sym.find(name, pos+1)) {
+        if (pos > 0 && pos+len < check_sym.size() && check_sym[pos-1] == ',' && check_sym[pos+len] == ',')
+            return true;
+    }
+    return false;
+}
+
+bool
+Model::parse_model(const char*& pos, const char* end, const std::string& check_sym)
+{
+    /*  pos is at the "interpretation" line.  On return pos is at the line after the model,
+        and text_begin/text_len point to the model text in the buffer, which must outlive the model.
+     *  check_sym is a comma-delimited list of symbols to parse
+        Returns true if success, false otherwise.
+     */
+    const char* model_begin = pos;
+    const char* eol = line_end(pos, end);
+    fill_meta_data(pos, eol);
+    pos = next_line(eol, end);
+
+    bool done = false;
+    while (!done && pos < end) {
+        const char* line = pos;
+        eol = line_end(line, end);
+        pos = next_line(eol, end);
+        if (*line == '%')
+            continue;
+        bool is_func = find_in_line(line, eol, Function_label) != eol;
+        bool is_rel = find_in_line(line, eol, Relation_label) != eol;
+        if (is_func || is_rel) {
+            int arity = find_arity(line, eol);
+            bool ignore_op = !is_checked_sym(line, eol, check_sym);
+            switch (arity) {
+            case 0:
+                break;
+            case 1:
+                done = parse_unary(line, eol, ignore_op);
+                break;
+            case 2:
+                done = parse_bin(pos, end, is_func, arity, ignore_op);
+                break;
+            default:   // ternary ops; ternary relations and higher arities are skipped
+                done = parse_bin(pos, end, is_func, 3, ignore_op || !is_func || arity > 3);
+            }
+        }
+    }
+    text_begin = model_begin;
+    text_len = pos - model_begin;
+    return true;
+}
+
+void
+Model::parse_row(const char* p, const char* e, size_t& pos, size_t table_end)
+{
+    /* input format:
+         0,1,0,  or   0,1,0 ])
+       store the numbers in [p, e) in the table cells from pos on, up to table_end
+    */
+    while (p < e && pos < table_end) {
+        bool neg = *p == '-' && p+1 < e && isdigit(p[1]);
+        if (neg)
+            ++p;
+        if (isdigit(*p)) {
+            int num = 0;
+            while (p < e && isdigit(*p))
+                num = num * 10 + (*p++ - '0');
+            tables.set_cell(pos++, neg? -num : num);
+        }
+        else
+            ++p;
+    }
+}
+
+bool
+Model::parse_unary(const char* line, const char* eol, bool ignore_op)
+{
+    /* sample line:
+       function('(_), [0,1,2 ]),
+    */
+    bool end_of_model = find_in_line(line, eol, Model_stopper) != eol;
     if (!ignore_op) {
-        if (is_func)
-            bin_ops.push_back(two_d);
+        const char* start = std::find(line, eol, '[');
+        const char* stop = std::find(start, eol, ']');
+        size_t pos = tables.add_table(order);
+        un_ops.push_back(pos);
+        if (start < eol)
+            parse_row(start+1, stop, pos, pos + order);
+    }
+    return end_of_model;
+}
+
+bool
+Model::parse_bin(const char*& pos, const char* end, bool is_func, size_t arity, bool ignore_op)
+{
+    /* Same as the stream version: pos is at the line after the "[", and on return
+       it is at the line after the "])" tokens.
+       Returns true if all functions/relations are extracted, false otherwise */
+    bool done = false;
+    bool end_model = false;
+    size_t cell = 0;
+    size_t table_end = 0;
+    if (!ignore_op) {
+        const size_t num_cells = arity == 3? order * order * order : order * order;
+        cell = tables.add_table(num_cells);
+        table_end = cell + num_cells;
+        if (arity == 3)
+            ternary_ops.push_back(cell);
+        else if (is_func)
+            bin_ops.push_back(cell);
         else
-            bin_rels.push_back(two_d);
+            bin_rels.push_back(cell);
+    }
+    while (!done && pos < end) {
+        const char* line = pos;
+        const char* eol = line_end(line, end);
+        pos = next_line(eol, end);
+        if (*line == '%')
+            continue;
+        if (find_in_line(line, eol, Function_stopper) != eol) {
+            done = true;
+            end_model = find_in_line(line, eol, Model_stopper) != eol;
+        }
+        if (!ignore_op)
+            parse_row(line, eol, cell, table_end);
     }
     return end_model;
 }
@@ -280,28 +511,8 @@ Model::count_unassigned()
         if (v == -1)
             ++count;
     }
-    for (auto op : un_ops) {
-        for (auto v : op) {
-            if (v == -1)
-                ++count;
-        }
-    }
-    for (auto op : bin_ops) {
-        for (auto row : op) {
-            for (auto v : row) {
-                if (v == -1)
-                    ++count;
-            }
-        }
-    }
-    for (auto op : bin_rels) {
-        for (auto row : op) {
-            for (auto v : row) {
-                if (v == -1)
-                    ++count;
-            }
-        }
-    }
+    // all the op/rel tables are in one buffer
+    count += tables.count(0, tables.size(), -1);
     return count;    
 }
 
@@ -313,7 +524,7 @@ Model::find_graph_size(size_t& num_vertices, size_t& num_edges)
     size_t num_bin_rels = bin_rels.size();
     size_t num_unary_ops = un_ops.size();
     size_t num_constants = constants.size();
-    size_t max_arity = num_bin_ops + num_bin_rels > 0 ? 2 : (num_unary_ops > 0? 1 : 0);
+    size_t max_arity = num_ternary_ops > 0? 3 : (num_bin_ops + num_bin_rels > 0 ? 2 : (num_unary_ops > 0? 1 : 0));
 
     if (max_arity == 0) {
         std::cerr << "find_graph_size: no unary or binary op/relations, abourt." << std::endl;
@@ -323,12 +534,14 @@ Model::find_graph_size(size_t& num_vertices, size_t& num_edges)
     // vertices for domain elements
     num_vertices = 2 * order;  // vertices for E and F
 
-    if (num_unary_ops + num_bin_ops > 0) 
+    if (num_unary_ops + num_bin_ops + num_ternary_ops > 0) 
         num_vertices += order;       // vertices for R
 
     if (num_bin_ops > 0 || num_bin_rels > 0 || num_ternary_ops > 0) {
         num_vertices += order;       // vertices for S
     }
+    if (num_ternary_ops > 0)
+        num_vertices += order;       // vertices for T
     if (num_bin_rels > 0) {
         num_vertices += 2;   // for True and False
     }
@@ -341,6 +554,7 @@ Model::find_graph_size(size_t& num_vertices, size_t& num_edges)
     num_vertices += num_constants;
     num_vertices += num_unary_ops * order;
     num_vertices += (num_bin_ops + num_bin_rels) * order * order;
+    num_vertices += num_ternary_ops * order * order * order;
 
     // debug print
     // std::cout << "debug, find_graph_size:  Number of vertices " << num_vertices << std::endl;
@@ -348,16 +562,20 @@ Model::find_graph_size(size_t& num_vertices, size_t& num_edges)
     // edges
     // edges for domain elements
     num_edges = order;      // undirected edge E to F
-    if (num_unary_ops + num_bin_ops > 0) 
+    if (num_unary_ops + num_bin_ops + num_ternary_ops > 0) 
         num_edges += order;     // undirected edges from E to R
    
-    if (num_bin_ops + num_bin_rels > 0)
+    if (num_bin_ops + num_bin_rels + num_ternary_ops > 0)
         num_edges += order;     // undirected edge E to S
 
+    if (num_ternary_ops > 0)
+        num_edges += order;     // undirected edge E to T
+
     // edges for op tables
     num_edges += num_constants;
     num_edges += 2 * order * num_unary_ops;
     num_edges += 3 * order * order * (num_bin_rels + num_bin_ops);
+    num_edges += 4 * order * order * order * num_ternary_ops;
 
     num_edges *= 2;   // directed edges
     // debug print
@@ -369,7 +587,8 @@ Model::find_graph_size(size_t& num_vertices, size_t& num_edges)
 void
 Model::color_vertices(int* ptn, int* lab, int ptn_sz)
 {
-    /*  vertices must be assigned in the order E, R, L, U, F, S, un_ops, bin_ops, bin_rels
+    /*  vertices must be assigned in the order E, R, L, U, F, S, T, un_ops, bin_ops, bin_rels,
+        ternary_ops
      */
     // colors
     for (size_t idx=0; idx < ptn_sz; ++idx) {
@@ -383,7 +602,7 @@ Model::color_vertices(int* ptn, int* lab, int ptn_sz)
     ptn[color_end - 1] = 0;
 
     // R segment
-    if (bin_ops.size() + un_ops.size() > 0) {
+    if (bin_ops.size() + un_ops.size() + ternary_ops.size() > 0) {
         color_end += order;
         ptn[color_end - 1] = 0;
     }
@@ -404,7 +623,13 @@ Model::color_vertices(int* ptn, int* lab, int ptn_sz)
     ptn[color_end - 1] = 0;
 
     // S, if exists
-    if (bin_ops.size() + bin_rels.size() > 0) {
+    if (bin_ops.size() + bin_rels.size() + ternary_ops.size() > 0) {
+        color_end += order;
+        ptn[color_end-1] = 0;
+    }
+
+    // T, if exists
+    if (ternary_ops.size() > 0) {
         color_end += order;
         ptn[color_end-1] = 0;
     }
@@ -426,6 +651,10 @@ Model::color_vertices(int* ptn, int* lab, int ptn_sz)
         color_end += order * order;
         ptn[color_end-1] = 0;
     }
+    for (auto op : ternary_ops) {
+        color_end += order * order * order;
+        ptn[color_end-1] = 0;
+    }
     /* debug print
     std::cout << "color array size: " << color_end << " space allocated: " << ptn_sz << std::endl;
     for (size_t idx=0; idx < ptn_sz; ++idx)
@@ -439,14 +668,8 @@ Model::count_truth_values(std::vector<size_t>& L_v_count)
 {
     // count number of times true or false appears in the relations tables.
     // -1 means the cell is not occupied
-    for (auto op : bin_rels) {
-        for (auto row : op) {
-            for (auto v : row) {
-                if (v != -1)
-                    L_v_count[v]++;
-            }
-        }
-    }
+    for (auto op : bin_rels)
+        tables.add_counts(op, op + order * order, L_v_count);
 }
 
 void
@@ -458,122 +681,75 @@ Model::count_occurrences(std::vector<size_t>& R_v_count)
         if (v != -1)
             R_v_count[v]++;
     }
-    for (auto op : un_ops) {
-        for (auto v : op) {
-            if (v != -1)
-                R_v_count[v]++;
-        }
-    }
-    for (auto op : bin_ops) {
-        for (auto row : op) {
-            for (auto v : row) {
-                if (v != -1)
-                    R_v_count[v]++;
-            }
-        }
-    }
-    for (auto op : ternary_ops) {  // not supported yet: 2023/09/10
-        for (auto first_arg : op) {
-            for (auto secord_arg : first_arg) {
-                for (auto v : secord_arg)  {
-                    if (v != -1)
-                        R_v_count[v]++;
-                }
-            }
-        }
-    }
+    for (auto op : un_ops)
+        tables.add_counts(op, op + order, R_v_count);
+    for (auto op : bin_ops)
+        tables.add_counts(op, op + order * order, R_v_count);
+    for (auto op : ternary_ops)
+        tables.add_counts(op, op + order * order * order, R_v_count);
 }
 
 size_t
 Model::count_unassigned_rels()
 {
     size_t count = 0;
-    for (auto op : bin_rels) {
-        for (auto row : op ) {
-            for (auto v : row) {
-                if (v == -1)
-                    ++count;
-            }
-        }
-    }
+    for (auto op : bin_rels)
+        count += tables.count(op, op + order * order, -1);
 
     return count;
 }
 
 void
-Model::build_vertices(sparsegraph& sg1, const int E_e, const int F_a, const int S_a, 
-                      const int R_v, const int L_v, const int U_v, const int A_c)
+Model::build_vertices(sparsegraph& sg1, const int E_e, const int F_a, const int S_a, const int T_a,
+                      const int A_c)
 {
-    std::vector<size_t> R_v_count(order, 0);
-    count_occurrences(R_v_count);
-    std::vector<size_t> L_v_count(2, 0);
-    count_truth_values(L_v_count);
-    size_t num_unassigned_rels = count_unassigned_rels();
+    /* Sets up the vertices whose edges do not depend on the values in the tables:
+       E, F, S, T and the table cells.  Their edge lists come first in sg1.e, followed by
+       the lists of U, L and R, which are set up by build_results.
+     */
 
-    // set up vertices for E, F, S, R, L, and U
-    // each node in E points to F, S, R and to each of the cells in a row
+    // set up vertices for E, F, S and T
+    // each node in E points to F, S, T, R and to each of the cells in a row
     // E does not point to L (true/false, not domain elements), or unassigned
-    // L, U, and S may not exist (ie. value zero)
+    // S and T may not exist (ie. value zero)
     const size_t num_S = bin_ops.size() + bin_rels.size();
-    bool has_R = (constants.size() + un_ops.size() + bin_ops.size()) > 0;
+    const size_t num_T = ternary_ops.size();
+    const size_t T_cells = num_T * order * order;    // ternary cells with a given argument
+    const bool   has_S = num_S + num_T > 0;
+    bool has_R = (constants.size() + un_ops.size() + bin_ops.size() + num_T) > 0;
 
-    // E points to first arg, second arg (if exists) and results (if exists)
-    const size_t E_outd = 1 + (num_S > 0? 1 : 0) + (has_R? 1 : 0);    //num of out edges per vertex
+    // E points to first arg, second and third arg (if exist) and results (if exists)
+    const size_t E_outd = 1 + (has_S? 1 : 0) + (num_T > 0? 1 : 0) + (has_R? 1 : 0);    //num of out edges per vertex
     const size_t E_size = E_outd * order;
-    const size_t F_outd = un_ops.size() * 1 + num_S * order + 1;  // out-degree of first arg
+    const size_t F_outd = un_ops.size() * 1 + num_S * order + T_cells + 1;  // out-degree of first arg
     const size_t F_size = F_outd * order;
-    const size_t S_outd = num_S * order + 1;          // out-degree of second arg
-    const size_t S_size = num_S? S_outd * order : 0;
-    // U may not exist
-    size_t U_pos = E_size + F_size + S_size;
-    const size_t U_size = num_unassigned;
-    size_t L_pos = U_pos + U_size;
-    // L may not exist
-    const size_t L_size = bin_rels.size() * order * order - num_unassigned_rels;   // L (true/false) does not point back to E
-    size_t R_pos = L_pos + L_size;
+    const size_t S_outd = num_S * order + T_cells + 1;          // out-degree of second arg
+    const size_t S_size = has_S? S_outd * order : 0;
+    const size_t T_outd = T_cells + 1;                          // out-degree of third arg
+    const size_t T_size = num_T? T_outd * order : 0;
 
     /* debug print
-    std::cout << "E_size " << E_size << " F_size " << F_size << " S_size " << S_size << " L_size " << L_size << std::endl;
-    std::cout << "debug: start R_pos: " << R_pos << "  L_pos: " << L_pos << " L_size: " << L_size << std::endl;
+    std::cout << "E_size " << E_size << " F_size " << F_size << " S_size " << S_size << std::endl;
     */
     for (size_t idx = 0; idx < order; ++idx) {
         sg1.v[E_e+idx] = E_outd * idx;
         sg1.d[E_e+idx] = E_outd;                         // out-degree
         sg1.v[F_a+idx] = E_size + F_outd * idx;
         sg1.d[F_a+idx] = F_outd;                         // out-degree
-        if (num_S > 0) {
+        if (has_S) {
             sg1.v[S_a+idx] = E_size + F_size + S_outd * idx;
             sg1.d[S_a+idx] = S_outd;                     // out-degree
         }
-
-        if (has_R) {
-            sg1.v[R_v+idx] = R_pos;
-            sg1.d[R_v+idx] = R_v_count[idx] + 1;
-            R_pos += sg1.d[R_v+idx];
-        }
-    }
-    // debug print
-    // std::cout << "debug: ending R_pos: " << R_pos << "  A_c " << A_c << std::endl;
-
-    // set up the vertex for unassigned
-    if (num_unassigned > 0) {
-        sg1.v[U_v] = U_pos;
-        sg1.d[U_v] = num_unassigned;
-    }
-
-    // set up vertices for rel values (true/false)
-    if (bin_rels.size() > 0) {
-        for (size_t idx=0; idx < 2; ++idx) {
-            sg1.v[L_v + idx] = L_pos; 
-            sg1.d[L_v + idx] = L_v_count[idx];
-            L_pos += sg1.d[L_v + idx];
+        if (num_T > 0) {
+            sg1.v[T_a+idx] = E_size + F_size + S_size + T_outd * idx;
+            sg1.d[T_a+idx] = T_outd;                     // out-degree
         }
     }
 
     // set up vertices of op/rel tables
-    // vertices are arranged in ascending order of arity: constants, unary, binary, ...
+    // vertices are arranged in ascending order of arity: constants, unary, binary, ternary
     size_t A_c_el = A_c;
-    size_t A_c_pos = R_pos;
+    size_t A_c_pos = E_size + F_size + S_size + T_size;
 
     // constants
     for (auto u : constants) {
@@ -584,44 +760,42 @@ Model::build_vertices(sparsegraph& sg1, const int E_e, const int F_a, const int
     }
  
     // unary op tables
-    for (auto op : un_ops) {
-        for (auto cell : op) {
-            sg1.v[A_c_el] = A_c_pos;
-            sg1.d[A_c_el] = 2;
-            A_c_pos += sg1.d[A_c_el];
-            A_c_el++;
-        }
+    for (size_t cell = 0; cell < un_ops.size() * order; ++cell) {
+        sg1.v[A_c_el] = A_c_pos;
+        sg1.d[A_c_el] = 2;
+        A_c_pos += sg1.d[A_c_el];
+        A_c_el++;
     }
     // debug print
     // std::cout << "un_ops. Domain element: " << A_c_el << " edge pos (A_c_pos) " << A_c_pos << std::endl;
 
     // binary op tables
-    for (auto op : bin_ops) {
-        for (auto row : op) {
-            for (auto cell : row) {
-                sg1.v[A_c_el] = A_c_pos;
-                sg1.d[A_c_el] = 3;
-                A_c_pos += sg1.d[A_c_el];
-                A_c_el++;
-            }
-        }
+    for (size_t cell = 0; cell < bin_ops.size() * order * order; ++cell) {
+        sg1.v[A_c_el] = A_c_pos;
+        sg1.d[A_c_el] = 3;
+        A_c_pos += sg1.d[A_c_el];
+        A_c_el++;
     }
     // debug print
     // std::cout << "bin_ops. Domain element: " << A_c_el << " edge pos " << A_c_pos << std::endl;
 
     // binary rel tables
-    for (auto op : bin_rels) {
-        for (auto row : op) {
-            for (auto cell : row) {
-                sg1.v[A_c_el] = A_c_pos;
-                sg1.d[A_c_el] = 3;
-                A_c_pos += sg1.d[A_c_el];
-                A_c_el++;
-            }
-        }
+    for (size_t cell = 0; cell < bin_rels.size() * order * order; ++cell) {
+        sg1.v[A_c_el] = A_c_pos;
+        sg1.d[A_c_el] = 3;
+        A_c_pos += sg1.d[A_c_el];
+        A_c_el++;
     }
     // debug print
-    // std::cout << "bin_rels. Domain element: " << A_c_el << " edge pos " << L_pos << " " << A_c_pos << std::endl;
+    // std::cout << "bin_rels. Domain element: " << A_c_el << " edge pos " << A_c_pos << std::endl;
+
+    // ternary op tables
+    for (size_t cell = 0; cell < num_T * order * order * order; ++cell) {
+        sg1.v[A_c_el] = A_c_pos;
+        sg1.d[A_c_el] = 4;
+        A_c_pos += sg1.d[A_c_el];
+        A_c_el++;
+    }
 }
 
 void
@@ -653,22 +827,24 @@ Model::debug_print_edges(sparsegraph& sg1, const int E_e, const int F_a, const i
 
 
 void
-Model::build_edges(sparsegraph& sg1, const int E_e, const int F_a, const int S_a, const int R_v,
-                   const int L_v, const int U_v, const int A_c)
+Model::build_edges(sparsegraph& sg1, const int E_e, const int F_a, const int S_a, const int T_a,
+                   const int R_v, const int A_c)
 {
+    /* Fills the edge lists of E, F, S and T, and the edges from the table cells to F, S and T.
+       The edges to the cell values are added by build_results.
+     */
     // E and F always exist
-    const size_t num_S = bin_ops.size() + bin_rels.size();
+    const size_t num_S = bin_ops.size() + bin_rels.size() + ternary_ops.size();
 
-    // E to R, F, and S
+    // E to R, F, S and T
     for (size_t idx = 0; idx < order; ++idx) {
         // joining F and E
         sg1.e[sg1.v[E_e+idx]] = F_a+idx;
         sg1.e[sg1.v[F_a+idx]] = E_e+idx;
         size_t epos = 1;
-        // joining R and E
-        if (constants.size() + un_ops.size() + bin_ops.size() > 0) {
+        // joining R and E, the edge from R back to E is added by build_results
+        if (constants.size() + un_ops.size() + bin_ops.size() + ternary_ops.size() > 0) {
             sg1.e[sg1.v[E_e+idx]+epos] = R_v+idx;
-            sg1.e[sg1.v[R_v+idx]] = E_e+idx;
             epos++;
         }
         // joining S and E
@@ -677,52 +853,23 @@ Model::build_edges(sparsegraph& sg1, const int E_e, const int F_a, const int S_a
             sg1.e[sg1.v[S_a+idx]] = E_e+idx;
             epos++;
         }
-        /* debug print
-        std::cerr << "debug Writing first pos " << sg1.v[E_e+idx] << " " << sg1.v[F_a+idx]
-               << " " << sg1.v[E_e+idx]+1 << " " << sg1.v[R_v+idx] << " " << sg1.v[E_e+idx]+2 << " " 
-               << " " << sg1.v[S_a+idx] << std::endl;
-        */
+        // joining T and E
+        if (ternary_ops.size() > 0) {
+            sg1.e[sg1.v[E_e+idx]+epos] = T_a+idx;
+            sg1.e[sg1.v[T_a+idx]] = E_e+idx;
+            epos++;
+        }
     }
 
-    // A_abc, a*b=c ->  edges from A_abc to F_a, S_b, and R_c or L_c or U_v
-    size_t A_c_el = A_c;
+    // A_abc, a*b=c ->  edges from A_abc to F_a, S_b, (and R_c or L_c or U_v in build_results)
+    size_t A_c_el = A_c + constants.size();
     std::vector<size_t> F_a_pos(order, 1);   // First position of F_a points to E_e
     std::vector<size_t> S_a_pos(order, 1);   // First position of S_a points to E_e
-    std::vector<size_t> R_v_pos(order, 1);   // First position of R_v points to E_e
-    std::vector<size_t> L_v_pos(2, 0);       // L_v does not point to E_e
-    size_t              U_v_pos = 0;         // U_v does not point to E_e
-
-    for (auto cval : constants) {
-        if (cval == -1 ) {
-            sg1.e[sg1.v[A_c_el]] = U_v;
-            sg1.e[sg1.v[U_v]+U_v_pos] = A_c_el; 
-            U_v_pos++;
-        }
-        else {
-            sg1.e[sg1.v[A_c_el]] = R_v + cval;
-            sg1.e[sg1.v[R_v+cval]+R_v_pos[cval]] = A_c_el; 
-            R_v_pos[cval]++;
-        }
-        A_c_el++;
-    }
 
     for (size_t op=0; op < un_ops.size(); ++op) {
         for (size_t f_arg=0; f_arg < order; ++f_arg) {
             sg1.e[sg1.v[A_c_el]] = F_a + f_arg;
             sg1.e[sg1.v[F_a+f_arg]+F_a_pos[f_arg]] = A_c_el; 
-
-            int cval = un_ops[op][f_arg];
-            if (cval == -1 ) {
-                sg1.e[sg1.v[A_c_el]+1] = U_v;
-                sg1.e[sg1.v[U_v]+U_v_pos] = A_c_el; 
-                U_v_pos++;
-            }
-            else {
-                sg1.e[sg1.v[A_c_el]+1] = R_v + cval;
-                sg1.e[sg1.v[R_v+cval]+R_v_pos[cval]] = A_c_el; 
-                R_v_pos[cval]++;
-            }
-            
             F_a_pos[f_arg]++;
             A_c_el++;
         }
@@ -730,32 +877,18 @@ Model::build_edges(sparsegraph& sg1, const int E_e, const int F_a, const int S_a
     // debug print
     // std::cerr << "un ops done" << std::endl;
  
-    for (size_t op=0; op < bin_ops.size(); ++op) {
-        for (size_t f_arg=0; f_arg < order; ++f_arg) {
-            for (size_t s_arg=0; s_arg < order; ++s_arg) {
+    // for the transpose, cell (a, b) is joined to F_b and S_a
+    for (size_t op=0; op < bin_ops.size() + bin_rels.size(); ++op) {
+        for (size_t row=0; row < order; ++row) {
+            for (size_t col=0; col < order; ++col) {
+                const size_t f_arg = transposed? col : row;
+                const size_t s_arg = transposed? row : col;
                 sg1.e[sg1.v[A_c_el]] = F_a + f_arg;
                 sg1.e[sg1.v[F_a+f_arg]+F_a_pos[f_arg]] = A_c_el; 
 
                 sg1.e[sg1.v[A_c_el]+1] = S_a + s_arg;
                 sg1.e[sg1.v[S_a+s_arg]+S_a_pos[s_arg]] = A_c_el; 
 
-                int cval = bin_ops[op][f_arg][s_arg];
-		if (cval == -1) {
-                    sg1.e[sg1.v[A_c_el]+2] = U_v;
-                    sg1.e[sg1.v[U_v]+U_v_pos] = A_c_el; 
-                    U_v_pos++;
-                }
-                else {
-                    sg1.e[sg1.v[A_c_el]+2] = R_v + cval;
-                    sg1.e[sg1.v[R_v+cval]+R_v_pos[cval]] = A_c_el; 
-                    R_v_pos[cval]++;
-                }
-                /* debug print
-                std::cout << "Writing R pos " << sg1.v[A_c_el] << " " << sg1.v[F_a+f_arg]+F_a_pos[f_arg]
-                   << " " << sg1.v[A_c_el]+1 << " " << sg1.v[S_a+s_arg]+S_a_pos[s_arg]
-                   << " " << sg1.v[A_c_el]+2 << " " << sg1.v[R_v+cval]+R_v_pos[cval] << std::endl;
-                */
-            
                 F_a_pos[f_arg]++;
                 S_a_pos[s_arg]++;
                 A_c_el++;
@@ -763,52 +896,154 @@ Model::build_edges(sparsegraph& sg1, const int E_e, const int F_a, const int S_a
         }
     }
     // debug print
-    // std::cerr << "bin ops done" << std::endl;
+    // std::cerr << "bin ops and rels done" << std::endl;
 
-    for (size_t op=0; op < bin_rels.size(); ++op) {
+    // A_abcd, f(a,b,c)=d -> edges from A_abcd to F_a, S_b, T_c (and R_d in build_results)
+    std::vector<size_t> T_a_pos(order, 1);   // First position of T_a points to E_e
+    for (size_t op=0; op < ternary_ops.size(); ++op) {
         for (size_t f_arg=0; f_arg < order; ++f_arg) {
             for (size_t s_arg=0; s_arg < order; ++s_arg) {
-                sg1.e[sg1.v[A_c_el]] = F_a + f_arg;
-                sg1.e[sg1.v[F_a+f_arg]+F_a_pos[f_arg]] = A_c_el; 
+                for (size_t t_arg=0; t_arg < order; ++t_arg) {
+                    sg1.e[sg1.v[A_c_el]] = F_a + f_arg;
+                    sg1.e[sg1.v[F_a+f_arg]+F_a_pos[f_arg]] = A_c_el;
 
-                sg1.e[sg1.v[A_c_el]+1] = S_a + s_arg;
-                sg1.e[sg1.v[S_a+s_arg]+S_a_pos[s_arg]] = A_c_el; 
+                    sg1.e[sg1.v[A_c_el]+1] = S_a + s_arg;
+                    sg1.e[sg1.v[S_a+s_arg]+S_a_pos[s_arg]] = A_c_el;
 
-                int cval = bin_rels[op][f_arg][s_arg];
-		if (cval == -1) {
-                    sg1.e[sg1.v[A_c_el]+2] = U_v;
-                    sg1.e[sg1.v[U_v]+U_v_pos] = A_c_el; 
-                    U_v_pos++;
-                }
-                else {
-                    sg1.e[sg1.v[A_c_el]+2] = L_v + cval;
-                    sg1.e[sg1.v[L_v+cval]+L_v_pos[cval]] = A_c_el; 
-                    L_v_pos[cval]++;
+                    sg1.e[sg1.v[A_c_el]+2] = T_a + t_arg;
+                    sg1.e[sg1.v[T_a+t_arg]+T_a_pos[t_arg]] = A_c_el;
+
+                    F_a_pos[f_arg]++;
+                    S_a_pos[s_arg]++;
+                    T_a_pos[t_arg]++;
+                    A_c_el++;
                 }
-                /* debug print
-                std::cout << A_c_el << " " << L_v+cval << " Writing L pos " << sg1.v[A_c_el] << " " << sg1.v[F_a+f_arg]+F_a_pos[f_arg]
-                   << " " << sg1.v[A_c_el]+1 << " " << sg1.v[S_a+s_arg]+S_a_pos[s_arg]
-                   << " " << sg1.v[A_c_el]+2 << " " << sg1.v[L_v+cval]+L_v_pos[cval] << std::endl;
-                */
-            
-                F_a_pos[f_arg]++;
-                S_a_pos[s_arg]++;
-                A_c_el++;
-                // debug print: std::cout << "Next pos: " << A_c_el << " F " << F_a_pos[f_arg] << " S " << S_a_pos[s_arg] << " L " <<  L_v_pos[cval] << std::endl;
             }
         }
     }
-    // debug print
-    // std::cerr << "bin rels done" << std::endl;
+}
+
+void
+Model::link_result(sparsegraph& sg1, const int A_c_el, const size_t epos, const int V_v, const int U_v, int cval)
+{
+    // joins table cell A_c_el to its value V_v+cval, or to U_v if unassigned
+    const int target = cval == -1? U_v : V_v + cval;
+    sg1.e[sg1.v[A_c_el]+epos] = target;
+    sg1.e[sg1.v[target]+sg1.d[target]] = A_c_el;
+    sg1.d[target]++;
+}
+
+void
+Model::build_results(sparsegraph& sg1, const int E_e, const int R_v, const int L_v, const int U_v, const int A_c)
+{
+    /* Sets up the part of the graph that depends on the values in the tables: the vertices
+       U, L and R, whose lists follow those of the table cells (the last vertices) in sg1.e,
+       and the last edge of each table cell, which points to the cell value.
+     */
+    std::vector<size_t> R_v_count(order, 0);
+    count_occurrences(R_v_count);
+    std::vector<size_t> L_v_count(2, 0);
+    count_truth_values(L_v_count);
+    bool has_R = (constants.size() + un_ops.size() + bin_ops.size() + ternary_ops.size()) > 0;
+
+    // the degrees count up from 0 (or 1 for R, which points back to E) while linking the cells
+    size_t pos = sg1.v[sg1.nv-1] + sg1.d[sg1.nv-1];
+    if (num_unassigned > 0) {
+        sg1.v[U_v] = pos;
+        sg1.d[U_v] = 0;
+        pos += num_unassigned;
+    }
+    if (bin_rels.size() > 0) {
+        for (size_t idx=0; idx < 2; ++idx) {
+            sg1.v[L_v + idx] = pos; 
+            sg1.d[L_v + idx] = 0;
+            pos += L_v_count[idx];
+        }
+    }
+    if (has_R) {
+        for (size_t idx = 0; idx < order; ++idx) {
+            sg1.v[R_v+idx] = pos;
+            sg1.e[pos] = E_e+idx;
+            sg1.d[R_v+idx] = 1;
+            pos += R_v_count[idx] + 1;
+        }
+    }
+
+    size_t A_c_el = A_c;
+    for (auto cval : constants)
+        link_result(sg1, A_c_el++, 0, R_v, U_v, cval);
+    for (auto op : un_ops) {
+        for (size_t cell = op; cell < op + order; ++cell)
+            link_result(sg1, A_c_el++, 1, R_v, U_v, tables.cell(cell));
+    }
+    for (auto op : bin_ops) {
+        for (size_t cell = op; cell < op + order * order; ++cell)
+            link_result(sg1, A_c_el++, 2, R_v, U_v, tables.cell(cell));
+    }
+    for (auto op : bin_rels) {
+        for (size_t cell = op; cell < op + order * order; ++cell)
+            link_result(sg1, A_c_el++, 2, L_v, U_v, tables.cell(cell));
+    }
+    for (auto op : ternary_ops) {
+        for (size_t cell = op; cell < op + order * order * order; ++cell)
+            link_result(sg1, A_c_el++, 3, R_v, U_v, tables.cell(cell));
+    }
 }
 
 bool
 Model::build_graph(bool save_cg)
 {
-    /*  8/26/2023: supports only constants, binary and unary operations
+    // one workspace per thread, reused by all the models canonicalized on that thread
+    static thread_local CanonWorkspace ws;
+    return build_graph(ws, save_cg);
+}
+
+bool
+Model::build_graph(CanonWorkspace& ws, bool save_cg)
+{
+    /* Canonical labelling of the model in iso, and with save_cg its canonical graph in cg.
+       With ws.anti_iso the transpose is canonicalized too, and the labelling whose key is
+       the smaller is kept, transposed telling canonical_key and compress_cms which one it
+       is; a model and its anti-isomorphic copies then get the same key.
+       Returns false for an empty graph.
+     */
+    transposed = false;
+    if (!ws.anti_iso || bin_ops.size() + bin_rels.size() == 0)
+        return canonize(ws, save_cg);
+    if (!canonize(ws, save_cg))
+        return false;
+    CanonKey key, transposed_key;
+    canonical_key(key);
+    std::vector<size_t> first_iso;
+    iso.swap(first_iso);
+    sparsegraph* first_cg = cg;
+    cg = nullptr;
+
+    transposed = true;
+    canonize(ws, save_cg);
+    canonical_key(transposed_key);
+    sparsegraph* unused_cg = first_cg;
+    if (!(transposed_key < key)) {
+        transposed = false;
+        iso.swap(first_iso);
+        unused_cg = cg;
+        cg = first_cg;
+    }
+    if (unused_cg != nullptr) {
+        SG_FREE(*unused_cg);
+        free(unused_cg);
+    }
+    return true;
+}
+
+bool
+Model::canonize(CanonWorkspace& ws, bool save_cg)
+{
+    /*  Supports constants, unary, binary and ternary operations and binary relations
         E represents the domain elements
         F represents the first argument of an operation
         S represents the second argument of an operation
+        T represents the third argument of a ternary operation
         R represents the function value (or result of applying the function)
         L represents the relation value (0/1 for false/true)
         A represents the operation table
@@ -816,7 +1051,7 @@ Model::build_graph(bool save_cg)
     num_unassigned = count_unassigned();
 
     bool   has_rel = bin_rels.size() > 0;
-    bool   has_func = bin_ops.size() + un_ops.size() + constants.size() > 0;
+    bool   has_func = bin_ops.size() + un_ops.size() + constants.size() + ternary_ops.size() > 0;
     if (!has_rel && !has_func)   // empty graph
         return false;
     size_t num_vertices, num_edges;
@@ -825,43 +1060,38 @@ Model::build_graph(bool save_cg)
         std::cerr << "build_graph:  Does not support models with only constants" << std::endl;
         return false;
     }
+    // The labelling of the direct and functional canonizers is kept with save_cg too, so
+    // that -c does not change the keys; the graph is then canonicalized only for cg.
+    std::vector<size_t> labelling;
+    // with collect_stats their costs go to ws.model_search as those of nauty do
+    const uint64_t start = ws.collect_stats? RunStats::cycles() : 0;
+    // the direct search reads the tables as they are, so it cannot label a transpose
+    const bool anti_iso = ws.anti_iso && bin_ops.size() + bin_rels.size() > 0;
+    if (ws.engine == CanonWorkspace::Auto_engine && max_arity == 1 && canonize_unary()) {
+        if (ws.collect_stats)
+            ws.model_search.add_direct(RunStats::cycles() - start, 0);
+        if (!save_cg)
+            return true;
+        iso.swap(labelling);
+    }
+    else if (ws.use_direct(order) && ternary_ops.empty() && !anti_iso) {
+        const size_t nodes = canonize_direct();
+        if (ws.collect_stats)
+            ws.model_search.add_direct(RunStats::cycles() - start, nodes);
+        if (!save_cg)
+            return true;
+        iso.swap(labelling);
+    }
+    if (ws.engine == CanonWorkspace::Auto_engine && build_relation_graph(ws, save_cg)) {
+        if (!labelling.empty())
+            iso.swap(labelling);
+        return true;
+    }
     bool   has_S = max_arity > 1;
     // debug print
     //std::cerr << "debug num_vertices: " << num_vertices << " num_edges: " << num_edges << std::endl;
 
-    DYNALLSTAT(int,lab,lab_sz);
-    DYNALLSTAT(int,ptn,ptn_sz);
-    DYNALLSTAT(int,orbits,orbits_sz);
-    DYNALLSTAT(int,map,map_sz);
-    static DEFAULTOPTIONS_SPARSEDIGRAPH(options);
-    statsblk stats;
-
-    /* Declare and initialize sparse graph structures */
-    SG_DECL(sg1);
-    SG_DECL(cg1);
-
-   /* Select option for canonical labelling */
-
-    options.getcanon = TRUE;
-    options.defaultptn = FALSE;
-
-    int mx = SETWORDSNEEDED(num_vertices);
-    nauty_check(WORDSIZE,mx,num_vertices,NAUTYVERSIONID);
-    // debug print
-    // std::cout << "debug: WORDSIZE " << WORDSIZE << " return value for SETWORDSNEEDED(num_vertices) " << mx << std::endl;
-
-    DYNALLOC1(int,lab,lab_sz,num_vertices,"malloc");
-    DYNALLOC1(int,ptn,ptn_sz,num_vertices,"malloc");
-    DYNALLOC1(int,orbits,orbits_sz,num_vertices,"malloc");
-    DYNALLOC1(int,map,map_sz,num_vertices,"malloc");
-
-    // debug print
-    // std::cerr << "debug lab_sz " << lab_sz  << " ptn_sz " << ptn_sz << " orbits_sz " << orbits_sz << " map_sz " << map_sz << std::endl;
-
-    // make the graph
-    SG_ALLOC(sg1,num_vertices,num_edges,"malloc");
-    sg1.nv = num_vertices;     // Number of vertices
-    sg1.nde = num_edges;       // Number of directed edges = twice of # undirected edges here
+    sparsegraph& sg1 = ws.sg;
 
     // vertices, offsets by domain element number to make them unique
     // E.g. E_e+2 represents domain element 2, F_a represents first function_argument (row) 2,
@@ -870,7 +1100,8 @@ Model::build_graph(bool save_cg)
     // A_c+2 represents the table cell (0, 2) (the cell position, not the value in the cell).
     // L_v+0,1 represents 0 or 1.  They cannot be renamed (moved) because they represents false/true
     // U_v     represents unassigned value
-    // The vertices must be created the same order as in color_graph: E R L U F S const un_op bin_op bin_rel
+    // T_a+2 represents 2 as the third argument of a ternary operation.
+    // The vertices must be created the same order as in color_graph: E R L U F S T const un_op bin_op bin_rel ternary_op
     int        ptr = 0;
     const int  E_e = ptr;
     ptr += order;
@@ -890,51 +1121,159 @@ Model::build_graph(bool save_cg)
     const int  S_a = ptr;
     if (has_S) ptr += order;
 
+    const int  T_a = ptr;
+    if (max_arity > 2) ptr += order;
+
     const int  A_c = ptr;
 
     // debug print
     //std::cerr << "debug E R L U F S A: " << E_e << " " << R_v << " " << L_v << " " 
     //            << U_v << " " << F_a << " " << S_a << " " << A_c << std::endl;
 
-    // vertices
-    build_vertices(sg1, E_e, F_a, S_a, R_v, L_v, U_v, A_c);
-
-    // color the graph
-    color_vertices(ptn, lab, ptn_sz);
-    /* debug print
-    std::cerr << " debug space allocated: " << ptn_sz << " " << lab_sz << std::endl;
-    for (size_t idx=0; idx < lab_sz; ++idx) 
-        std::cout << lab[idx] << " ";
-    std::cout << std::endl;
-    for (size_t idx=0; idx < ptn_sz; ++idx)
-        std::cout << ptn[idx] << " ";
-    std::cerr << std::endl;
-    */
-
-    // edges
-    build_edges(sg1, E_e, F_a, S_a, R_v, L_v, U_v, A_c);
+    // The vertices, edges and colors that do not depend on the table values are the same
+    // for all models of one signature; the workspace keeps them from the previous model.
+    const std::vector<size_t> signature {CanonWorkspace::Sparse_layout, order, constants.size(), un_ops.size(),
+                                         bin_ops.size(), bin_rels.size(), ternary_ops.size(), num_unassigned > 0,
+                                         transposed};
+    if (ws.template_sig != signature)
+        ws.swap_templates();     // the spare template may have it; if not, sg becomes the spare
+    if (ws.template_sig != signature) {
+        // make the graph
+        ws.reserve(num_vertices, num_edges);
+
+        // vertices
+        build_vertices(sg1, E_e, F_a, S_a, T_a, A_c);
+
+        // edges
+        build_edges(sg1, E_e, F_a, S_a, T_a, R_v, A_c);
+
+        // color the graph
+        ws.template_ptn.resize(num_vertices);
+        ws.template_lab.resize(num_vertices);
+        color_vertices(ws.template_ptn.data(), ws.template_lab.data(), num_vertices);
+        ws.template_sig = signature;
+    }
+    build_results(sg1, E_e, R_v, L_v, U_v, A_c);
+    std::copy(ws.template_ptn.begin(), ws.template_ptn.end(), ws.ptn);
+    std::copy(ws.template_lab.begin(), ws.template_lab.end(), ws.lab);
+    if (ws.refine_cells)
+        refine_cells(ws.lab, ws.ptn, E_e, R_v, F_a, S_a, T_a, has_S);
+    if (ws.invariant == CanonWorkspace::Isonaut_invariant)
+        vertex_invariants(ws.vertex_inv, num_vertices, E_e, R_v, F_a, S_a, A_c, has_S);
     /* debug print
     // debug_print_edges(sg1, E_e, F_a, S_a, R_v, L_v, A_c);
     std::cerr << "debug sg1:\n" << graph_to_string(&sg1) << std::endl;
+    for (size_t idx=0; idx < num_vertices; ++idx) 
+        std::cout << ws.lab[idx] << " ";
+    std::cout << std::endl;
+    for (size_t idx=0; idx < num_vertices; ++idx)
+        std::cout << ws.ptn[idx] << " ";
+    std::cerr << std::endl;
     */
 
     // compute canonical form
-    sparsenauty(&sg1,lab,ptn,orbits,&options,&stats,&cg1);
+    ws.canonicalize(ws.graph_engine(order));
 
     // debug print
-    // std::cerr << "debug, graph string: " << graph_to_string(&cg1) << std::endl;
+    // std::cerr << "debug, cg string: " << graph_to_string(&ws.cg) << std::endl;
 
-    for (size_t iptr = 0; iptr < order; ++iptr)
-        iso.push_back(lab[iptr]);
+    if (labelling.empty()) {
+        for (size_t iptr = 0; iptr < order; ++iptr)
+            iso.push_back(ws.lab[iptr]);
+    }
+    else
+        iso.swap(labelling);
 
-    sortlists_sg(&cg1);
-    // debug print
-    // std::cerr << "debug, cg string: " << std::endl;  // << graph_to_string(&cg1) << std::endl;
+    if (save_cg)
+        cg = copy_sg(&ws.cg, NULL);
+    return true;
+}
 
-    SG_FREE(sg1);
+bool
+Model::build_relation_graph(CanonWorkspace& ws, bool save_cg)
+{
+    /* Models with binary relations only (no unassigned cells): instead of the order^2 cell
+       vertices, one layer of order vertices per relation, with an arc x -> y in layer k for
+       x R_k y, x != y, and the copies of an element in adjacent layers linked both ways.
+       The loops are colours: the cells are the layers in order, each split into the elements
+       without and with a loop in that relation (and by element invariants with refine_cells).
+       Layer 0 comes first, so lab[0..order) is the canonical labelling of the elements.
+       For the transpose the arcs are reversed.
+       Returns false when the model has other tables and needs build_graph's layout.
+     */
+    if (bin_rels.empty() || bin_ops.size() + un_ops.size() + constants.size() + ternary_ops.size() > 0 ||
+        num_unassigned > 0)
+        return false;
+
+    const size_t num_layers = bin_rels.size();
+    const size_t num_vertices = num_layers * order;
+    size_t num_edges = 2 * (num_layers - 1) * order;
+    for (auto op : bin_rels) {
+        for (size_t x = 0; x < order; ++x) {
+            for (size_t y = 0; y < order; ++y)
+                num_edges += y != x && tables.cell(op + x * order + y) == 1;
+        }
+    }
+    ws.reserve(num_vertices, num_edges);
+    ws.template_sig.clear();
+    sparsegraph& sg1 = ws.sg;
+
+    size_t pos = 0;
+    const size_t row_step = transposed? 1 : order;
+    const size_t col_step = transposed? order : 1;
+    for (size_t k = 0; k < num_layers; ++k) {
+        const size_t op = bin_rels[k];
+        for (size_t x = 0; x < order; ++x) {
+            const size_t v = k * order + x;
+            sg1.v[v] = pos;
+            for (size_t y = 0; y < order; ++y) {
+                if (y != x && tables.cell(op + x * row_step + y * col_step) == 1)
+                    sg1.e[pos++] = k * order + y;
+            }
+            if (k > 0)
+                sg1.e[pos++] = v - order;
+            if (k + 1 < num_layers)
+                sg1.e[pos++] = v + order;
+            sg1.d[v] = pos - sg1.v[v];
+        }
+    }
+
+    std::vector<uint64_t> inv(order, 0);
+    if (ws.refine_cells || ws.invariant == CanonWorkspace::Isonaut_invariant)
+        element_invariants(inv);
+    std::vector<size_t> elems(order);
+    for (size_t k = 0; k < num_layers; ++k) {
+        const size_t op = bin_rels[k];
+        auto loop = [this, op](size_t x) { return tables.cell(op + x * order + x) == 1; };
+        auto refined = ws.refine_cells;
+        for (size_t x = 0; x < order; ++x)
+            elems[x] = x;
+        std::sort(elems.begin(), elems.end(), [&](size_t a, size_t b) {
+            if (loop(a) != loop(b))
+                return loop(b);
+            if (refined && inv[a] != inv[b])
+                return inv[a] < inv[b];
+            return a < b;
+        });
+        for (size_t idx = 0; idx < order; ++idx) {
+            const size_t x = elems[idx];
+            ws.lab[k * order + idx] = k * order + x;
+            ws.ptn[k * order + idx] = idx + 1 < order && loop(elems[idx + 1]) == loop(x) &&
+                                      (!refined || inv[elems[idx + 1]] == inv[x]) ? 1 : 0;
+        }
+    }
+    if (ws.invariant == CanonWorkspace::Isonaut_invariant) {
+        ws.vertex_inv.resize(num_vertices);
+        for (size_t v = 0; v < num_vertices; ++v)
+            ws.vertex_inv[v] = int(inv[v % order] & 0x7FFFFFFF);
+    }
+
+    // a digraph, which Traces does not take
+    ws.canonicalize(ws.engine == CanonWorkspace::Dense_engine? CanonWorkspace::Dense_engine : CanonWorkspace::Nauty_engine);
+
+    iso.assign(ws.lab, ws.lab + order);
     if (save_cg)
-        cg = copy_sg(&cg1, NULL);
-    SG_FREE(cg1);
+        cg = copy_sg(&ws.cg, NULL);
     return true;
 }
 
@@ -1018,12 +1357,24 @@ Model::compress_cms() const
     for (size_t v = 0; v < order; ++v) 
         inv[iso[v]] = v;
 
+    const size_t row_step = transposed? 1 : order;   // cell (r, c) of the transpose is (c, r)
+    const size_t col_step = transposed? order : 1;
     std::string cms;
+    for (auto to : ternary_ops) {
+        for (size_t a = 0; a < order; ++a) {
+            for (size_t b = 0; b < order; ++b) {
+                const size_t row = to + (iso[a] * order + iso[b]) * order;
+                for (size_t c = 0; c < order; ++c)
+                    compress_str(get_cell_value(inv, tables.cell(row + iso[c])), el_fixed_width, cms);
+            }
+        }
+        remove_unassigned(cms);
+    }
     for (auto bo : bin_ops) {
         bool is_even = true;
         for (size_t r = 0; r < order; ++r) {
             for (size_t c = 0; c < order; ++c) {
-                int v = get_cell_value(inv, bo[iso[r]][iso[c]]);
+                int v = get_cell_value(inv, tables.cell(bo + iso[r] * row_step + iso[c] * col_step));
                 if (order > 4 && order < 16) {
                     compress_small_str(is_even, v, cms);
                     is_even = !is_even;
@@ -1043,7 +1394,7 @@ Model::compress_cms() const
     for (auto bo : bin_rels) {
         for (size_t r = 0; r < order; ++r) {
             for (size_t c = 0; c < order; ++c) {
-                int v = bo[iso[r]][iso[c]];
+                int v = tables.cell(bo + iso[r] * row_step + iso[c] * col_step);
                 compress_str(v, 1, cms);
             }
         }
@@ -1054,7 +1405,7 @@ Model::compress_cms() const
     }
     for (auto uo : un_ops) {
         for (size_t r = 0; r < order; ++r ) {
-            int v = get_cell_value(inv, uo[iso[r]]);
+            int v = get_cell_value(inv, tables.cell(uo + iso[r]));
             compress_str(v, el_fixed_width, cms);
         }
         //while (cms[cms.size()-1] == unassigned)
@@ -1075,3 +1426,795 @@ Model::compress_cms() const
     return cms;
 }
 
+
+uint64_t
+Model::key_header() const
+{
+    // order, unassigned flag and number of tables of each kind, which fix the layout of the key
+    return (uint64_t(order) & 0xFFFFFF) | (uint64_t(num_unassigned > 0) << 24) |
+           ((uint64_t(bin_ops.size()) & 0xFF) << 25) | ((uint64_t(bin_rels.size()) & 0xFF) << 33) |
+           ((uint64_t(un_ops.size()) & 0xFF) << 41) | ((uint64_t(constants.size()) & 0xFF) << 49) |
+           ((uint64_t(ternary_ops.size()) & 0x7F) << 57);
+}
+
+void
+Model::raw_tables(std::string& raw) const
+{
+    /* The tables as parsed, not relabelled: equal for two models only if they are the same
+       model.  The order, the number of tables of each kind and their positions fix which
+       table is which.
+     */
+    auto append_words = [&raw](const void* words, size_t num_bytes) {
+        raw.append(reinterpret_cast<const char*>(words), num_bytes);
+    };
+    const size_t layout[] = {order, ternary_ops.size(), bin_ops.size(), bin_rels.size(), un_ops.size(), constants.size()};
+    raw.clear();
+    append_words(layout, sizeof(layout));
+    append_words(ternary_ops.data(), ternary_ops.size() * sizeof(size_t));
+    append_words(bin_ops.data(), bin_ops.size() * sizeof(size_t));
+    append_words(bin_rels.data(), bin_rels.size() * sizeof(size_t));
+    append_words(un_ops.data(), un_ops.size() * sizeof(size_t));
+    append_words(constants.data(), constants.size() * sizeof(int));
+    tables.append_raw(raw);
+}
+
+void
+Model::element_invariants(std::vector<uint64_t>& inv) const
+{
+    /* inv[x] = a hash of properties of element x that do not depend on the labelling:
+       for each unary op, whether x is fixed and the size of its preimage; for each binary
+       op, whether x is idempotent, a left or right identity, a left or right zero, how often
+       it is a value and the number of distinct values in its row and column; for each
+       relation, x R x and the out- and in-degree of x; for each ternary op, whether
+       f(x,x,x) = x and how often x is a value; which constants name x.
+       With transposed, those of the transpose.
+     */
+    inv.assign(order, 0x9E3779B97F4A7C15ULL);
+    auto add = [&inv](size_t x, uint64_t prop) {    // mixed in as CanonKey::hash_words does
+        inv[x] = (inv[x] ^ prop) * 0xFF51AFD7ED558CCDULL;
+        inv[x] ^= inv[x] >> 33;
+    };
+    std::vector<size_t> counts(order);
+    for (auto op : un_ops) {
+        counts.assign(order, 0);
+        tables.add_counts(op, op + order, counts);
+        for (size_t x = 0; x < order; ++x) {
+            add(x, tables.cell(op + x) == int(x));
+            add(x, counts[x]);
+        }
+    }
+    std::vector<bool> seen(order);
+    for (auto op : bin_ops) {
+        counts.assign(order, 0);
+        tables.add_counts(op, op + order * order, counts);
+        for (size_t x = 0; x < order; ++x) {
+            bool left_id = true, right_id = true, left_zero = true, right_zero = true;
+            size_t row_vals = 0, col_vals = 0;
+            std::fill(seen.begin(), seen.end(), false);
+            for (size_t y = 0; y < order; ++y) {
+                int v = tables.cell(op + x * order + y);
+                left_id = left_id && v == int(y);
+                left_zero = left_zero && v == int(x);
+                if (v >= 0 && !seen[v]) {
+                    seen[v] = true;
+                    row_vals++;
+                }
+            }
+            std::fill(seen.begin(), seen.end(), false);
+            for (size_t y = 0; y < order; ++y) {
+                int v = tables.cell(op + y * order + x);
+                right_id = right_id && v == int(y);
+                right_zero = right_zero && v == int(x);
+                if (v >= 0 && !seen[v]) {
+                    seen[v] = true;
+                    col_vals++;
+                }
+            }
+            if (transposed) {   // rows and columns exchange roles
+                std::swap(left_id, right_id);
+                std::swap(left_zero, right_zero);
+                std::swap(row_vals, col_vals);
+            }
+            add(x, tables.cell(op + x * order + x) == int(x));
+            add(x, left_id | right_id << 1 | left_zero << 2 | right_zero << 3);
+            add(x, counts[x]);
+            add(x, row_vals);
+            add(x, col_vals);
+        }
+    }
+    for (auto op : bin_rels) {
+        for (size_t x = 0; x < order; ++x) {
+            size_t out_deg = 0, in_deg = 0;
+            for (size_t y = 0; y < order; ++y) {
+                out_deg += tables.cell(op + x * order + y) == 1;
+                in_deg += tables.cell(op + y * order + x) == 1;
+            }
+            if (transposed)
+                std::swap(out_deg, in_deg);
+            add(x, tables.cell(op + x * order + x) + 1);
+            add(x, out_deg);
+            add(x, in_deg);
+        }
+    }
+    for (auto op : ternary_ops) {
+        counts.assign(order, 0);
+        tables.add_counts(op, op + order * order * order, counts);
+        for (size_t x = 0; x < order; ++x) {
+            add(x, tables.cell(op + (x * order + x) * order + x) == int(x));
+            add(x, counts[x]);
+        }
+    }
+    for (size_t idx = 0; idx < constants.size(); ++idx) {
+        if (constants[idx] >= 0)
+            add(constants[idx], idx + 1);
+    }
+}
+
+void
+Model::vertex_invariants(std::vector<int>& vinv, size_t num_vertices, const int E_e, const int R_v,
+                         const int F_a, const int S_a, const int A_c, bool has_S) const
+{
+    /* Vertex invariants for the isonaut invarproc, for the regular tables where refinement
+       alone stalls, such as Latin squares:
+       - unary op cell f(x): the number of distinct iterates of x under f
+       - binary op cell x*y: the number of intercalates through it, i.e. (x', y') with
+         x'*y = x*y' and x'*y' = x*y (orders up to Intercalate_max_order)
+       - relation cell x R y: the number of w with x R w and w R y
+       F_x, S_x and R_x get the sums over the cells in row x, column x and of value x
+       (column x and row x for a transpose, whose F_x is joined to column x),
+       E_x a combination of those; other vertices get 0.
+     */
+    std::vector<uint64_t> inv(num_vertices, 0);
+    const bool has_R = constants.size() + un_ops.size() + bin_ops.size() + ternary_ops.size() > 0;
+    size_t A_c_el = A_c + constants.size();   // the table cells in the order of build_edges
+    const int  row_a = transposed? S_a : F_a;   // the vertices joined to row x and column x
+    const int  col_a = transposed? F_a : S_a;
+    std::vector<bool> seen(order);
+    for (auto op : un_ops) {
+        for (size_t x = 0; x < order; ++x, ++A_c_el) {
+            uint64_t len = 0;
+            std::fill(seen.begin(), seen.end(), false);
+            for (int y = x; y >= 0 && !seen[y]; y = tables.cell(op + y)) {
+                seen[y] = true;
+                len++;
+            }
+            const int v = tables.cell(op + x);
+            inv[A_c_el] = len;
+            inv[F_a + x] += len;
+            if (v >= 0)
+                inv[R_v + v] += len;
+        }
+    }
+    for (auto op : bin_ops) {
+        for (size_t x = 0; x < order; ++x) {
+            for (size_t y = 0; y < order; ++y, ++A_c_el) {
+                const int a = tables.cell(op + x * order + y);
+                uint64_t count = 0;
+                for (size_t x2 = 0; a >= 0 && order <= Intercalate_max_order && x2 < order; ++x2) {
+                    if (x2 == x)
+                        continue;
+                    const int b = tables.cell(op + x2 * order + y);
+                    for (size_t y2 = 0; b >= 0 && y2 < order; ++y2) {
+                        if (y2 != y && tables.cell(op + x * order + y2) == b && tables.cell(op + x2 * order + y2) == a)
+                            count++;
+                    }
+                }
+                inv[A_c_el] = count;
+                inv[row_a + x] += count;
+                inv[col_a + y] += count;
+                if (a >= 0)
+                    inv[R_v + a] += count;
+            }
+        }
+    }
+    for (auto op : bin_rels) {
+        for (size_t x = 0; x < order; ++x) {
+            for (size_t y = 0; y < order; ++y, ++A_c_el) {
+                uint64_t count = 0;
+                for (size_t w = 0; w < order; ++w)
+                    count += tables.cell(op + x * order + w) == 1 && tables.cell(op + w * order + y) == 1;
+                inv[A_c_el] = count;
+                inv[row_a + x] += count;
+                inv[col_a + y] += count;
+            }
+        }
+    }
+    for (size_t x = 0; x < order; ++x)
+        inv[E_e + x] = inv[F_a + x] * 3 + (has_S? inv[S_a + x] * 5 : 0) + (has_R? inv[R_v + x] * 7 : 0);
+
+    vinv.resize(num_vertices);
+    for (size_t v = 0; v < num_vertices; ++v)
+        vinv[v] = int(inv[v] & 0x7FFFFFFF);
+}
+
+// state of canonize_direct
+struct Model::DirectSearch {
+    std::vector<size_t>   sorted;        // the elements in increasing order of invariant
+    std::vector<size_t>   group_begin;   // [group_begin[pos], group_end[pos]): the elements of sorted
+    std::vector<size_t>   group_end;     // with the invariant of sorted[pos]
+    std::vector<bool>     swap_auto;     // [x*order+y]: swapping x and y is an automorphism
+    std::vector<int>      label;         // old element -> new label, -1 if not assigned yet
+    std::vector<size_t>   elems;         // new label -> old element, for the labels assigned
+    std::vector<uint32_t> code;
+    std::vector<uint32_t> best;
+    std::vector<size_t>   best_elems;
+    size_t                nodes;         // labels tried, the nodes of the search tree
+};
+
+void
+Model::direct_code(const std::vector<int>& label, const std::vector<size_t>& elems, size_t depth,
+                   std::vector<uint32_t>& code) const
+{
+    /* The code of the model relabelled by label, as far as the new labels 0..depth are
+       assigned (elems[k] has label k): the constants, then for each k up to depth the
+       cells with max(row, col) = k in the order (k,0), (0,k), (k,1), ..., (k,k) of each
+       binary op and relation, and cell k of each unary op.  An op value is its new label + 1
+       (0 for unassigned); a value whose label is not assigned yet will get one above depth,
+       so depth + 2 is a lower bound of its code.
+     */
+    auto value_code = [&label, depth](int v) -> uint32_t {
+        if (v < 0)
+            return 0;
+        return label[v] >= 0? label[v] + 1 : depth + 2;
+    };
+    code.clear();
+    for (auto cst : constants)
+        code.push_back(value_code(cst));
+    for (size_t k = 0; k <= depth; ++k) {
+        const size_t xk = elems[k];
+        for (auto op : bin_ops) {
+            for (size_t j = 0; j < k; ++j) {
+                code.push_back(value_code(tables.cell(op + xk * order + elems[j])));
+                code.push_back(value_code(tables.cell(op + elems[j] * order + xk)));
+            }
+            code.push_back(value_code(tables.cell(op + xk * order + xk)));
+        }
+        for (auto op : bin_rels) {
+            for (size_t j = 0; j < k; ++j) {
+                code.push_back(tables.cell(op + xk * order + elems[j]) + 1);
+                code.push_back(tables.cell(op + elems[j] * order + xk) + 1);
+            }
+            code.push_back(tables.cell(op + xk * order + xk) + 1);
+        }
+        for (auto op : un_ops)
+            code.push_back(value_code(tables.cell(op + xk)));
+    }
+}
+
+bool
+Model::is_swap_automorphism(size_t x, size_t y) const
+{
+    // whether exchanging elements x and y maps every table and constant onto itself
+    auto swap = [x, y](int v) -> int { return v == int(x)? y : (v == int(y)? x : v); };
+    for (auto cst : constants) {
+        if (swap(cst) != cst)
+            return false;
+    }
+    for (auto op : un_ops) {
+        for (size_t a = 0; a < order; ++a) {
+            if (tables.cell(op + swap(a)) != swap(tables.cell(op + a)))
+                return false;
+        }
+    }
+    for (size_t kind = 0; kind < 2; ++kind) {
+        for (auto op : kind == 0? bin_ops : bin_rels) {
+            for (size_t a = 0; a < order; ++a) {
+                for (size_t b = 0; b < order; ++b) {
+                    int v = tables.cell(op + a * order + b);
+                    if (tables.cell(op + swap(a) * order + swap(b)) != (kind == 0? swap(v) : v))
+                        return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void
+Model::direct_search(DirectSearch& ds, size_t depth)
+{
+    /* Tries each unlabelled element of the invariant group of position depth as new label
+       depth, pruning a branch as soon as the lower bound of its code exceeds the best code
+       found.  At a leaf the code is exact and a smaller one becomes the best.
+       An element y whose exchange with an element x tried before at this node is an
+       automorphism is skipped: x and y are both unlabelled, so the subtree of y is the
+       image of that of x and has the same codes.
+     */
+    const size_t begin = ds.group_begin[depth];
+    for (size_t pos = begin; pos < ds.group_end[depth]; ++pos) {
+        const size_t y = ds.sorted[pos];
+        if (ds.label[y] >= 0)
+            continue;
+        bool is_image = false;
+        for (size_t prev = begin; !is_image && prev < pos; ++prev) {
+            const size_t x = ds.sorted[prev];
+            is_image = ds.label[x] < 0 && ds.swap_auto[x * order + y];
+        }
+        if (is_image)
+            continue;
+
+        ds.label[y] = depth;
+        ds.elems[depth] = y;
+        ds.nodes++;
+        direct_code(ds.label, ds.elems, depth, ds.code);
+        int cmp = ds.best.empty()? -1 : 0;
+        for (size_t idx = 0; cmp == 0 && idx < ds.code.size(); ++idx) {
+            if (ds.code[idx] != ds.best[idx])
+                cmp = ds.code[idx] < ds.best[idx]? -1 : 1;
+        }
+        if (depth + 1 == order) {
+            if (cmp < 0) {
+                ds.best = ds.code;
+                ds.best_elems = ds.elems;
+            }
+        }
+        else if (cmp <= 0)   // with cmp < 0 the bounds may still lose to best later on
+            direct_search(ds, depth + 1);
+        ds.label[y] = -1;
+    }
+}
+
+size_t
+Model::canonize_direct()
+{
+    /* Canonical labelling without nauty, for small orders: the relabelling, among those that
+       list the elements in increasing order of element_invariants, whose direct_code is the
+       least.  Isomorphic models have the same set of such relabelled models, so they get
+       the same one.  Sets iso as build_graph does (iso[new label] = element).
+       Returns the number of nodes of the search.
+     */
+    std::vector<uint64_t> inv;
+    element_invariants(inv);
+    DirectSearch ds;
+    ds.sorted.resize(order);
+    for (size_t x = 0; x < order; ++x)
+        ds.sorted[x] = x;
+    std::sort(ds.sorted.begin(), ds.sorted.end(),
+              [&inv](size_t a, size_t b) { return inv[a] < inv[b] || (inv[a] == inv[b] && a < b); });
+    ds.group_begin.resize(order);
+    ds.group_end.resize(order);
+    for (size_t pos = 0; pos < order; ++pos) {
+        bool same = pos > 0 && inv[ds.sorted[pos]] == inv[ds.sorted[pos - 1]];
+        ds.group_begin[pos] = same? ds.group_begin[pos - 1] : pos;
+    }
+    for (size_t pos = order; pos-- > 0; ) {
+        bool same = pos + 1 < order && inv[ds.sorted[pos]] == inv[ds.sorted[pos + 1]];
+        ds.group_end[pos] = same? ds.group_end[pos + 1] : pos + 1;
+    }
+    ds.swap_auto.assign(order * order, false);
+    for (size_t pos = 0; pos < order; ++pos) {
+        for (size_t pos2 = pos + 1; pos2 < ds.group_end[pos]; ++pos2) {
+            const size_t x = ds.sorted[pos], y = ds.sorted[pos2];
+            ds.swap_auto[x * order + y] = ds.swap_auto[y * order + x] = is_swap_automorphism(x, y);
+        }
+    }
+    ds.label.assign(order, -1);
+    ds.elems.assign(order, 0);
+    ds.nodes = 0;
+    direct_search(ds, 0);
+    iso = ds.best_elems;
+    return ds.nodes;
+}
+
+bool
+Model::canonize_unary()
+{
+    /* Canonical labelling without nauty for models with unary ops and constants only and
+       no unassigned cells.  One unary op is a functional graph, labelled by canonize_functional
+       in near-linear time.  Several ops are refined by canonize_unary_refined, which only
+       succeeds when the refinement separates all the elements.  Returns false if the model
+       needs the graph; sets iso as build_graph does otherwise.
+     */
+    if (un_ops.empty() || bin_ops.size() + bin_rels.size() + ternary_ops.size() > 0 || num_unassigned > 0)
+        return false;
+    if (un_ops.size() > 1)
+        return canonize_unary_refined();
+    canonize_functional();
+    return true;
+}
+
+static size_t
+least_rotation(const std::vector<int>& s)
+{
+    // start of the lexicographically least rotation of s, in linear time
+    const size_t n = s.size();
+    size_t i = 0, j = 1, k = 0;
+    while (i < n && j < n && k < n) {
+        const int a = s[(i + k) % n], b = s[(j + k) % n];
+        if (a == b) {
+            ++k;
+            continue;
+        }
+        if (a > b)
+            i += k + 1;
+        else
+            j += k + 1;
+        if (i == j)
+            ++j;
+        k = 0;
+    }
+    return std::min(i, j);
+}
+
+void
+Model::canonize_functional()
+{
+    /* x -> f(x) of the only unary op is a functional graph: cycles with a rooted tree hanging
+       from each cycle element.  The trees are peeled off leaves first, and each element gets
+       an id level by level (AHU): at each height the elements are sorted by the constants
+       equal to them and the sorted ids of their tree children, and equal keys get equal ids,
+       so equal ids mean isomorphic trees.  Each cycle is read from its least rotation of root
+       ids, and the cycles are sorted by that sequence.  The new labels go to the cycles in
+       that order, each cycle's elements first, then its trees breadth first with the children
+       by increasing id.  Isomorphic models only differ by the order of isomorphic siblings or
+       cycles, which does not change the relabelled table.
+     */
+    const size_t op = un_ops[0];
+    auto f = [this, op](size_t x) -> size_t { return tables.cell(op + x); };
+
+    // peel the trees, leaves first; what is left are the cycle elements
+    std::vector<size_t> indeg(order, 0), height(order, 0), peeled;
+    for (size_t x = 0; x < order; ++x)
+        indeg[f(x)]++;
+    peeled.reserve(order);
+    for (size_t x = 0; x < order; ++x) {
+        if (indeg[x] == 0)
+            peeled.push_back(x);
+    }
+    for (size_t idx = 0; idx < peeled.size(); ++idx) {
+        const size_t x = peeled[idx], y = f(x);
+        height[y] = std::max(height[y], height[x] + 1);
+        if (--indeg[y] == 0)
+            peeled.push_back(y);
+    }
+    std::vector<bool> on_cycle(order, true);
+    for (auto x : peeled)
+        on_cycle[x] = false;
+
+    // tree children of each element, [child_begin[y], child_begin[y+1]) in children
+    std::vector<size_t> child_begin(order + 1, 0), children(peeled.size());
+    for (auto x : peeled)
+        child_begin[f(x) + 1]++;
+    for (size_t y = 0; y < order; ++y)
+        child_begin[y + 1] += child_begin[y];
+    std::vector<size_t> fill(child_begin.begin(), child_begin.end() - 1);
+    for (auto x : peeled)
+        children[fill[f(x)]++] = x;
+
+    // the elements by height
+    size_t max_height = 0;
+    for (size_t x = 0; x < order; ++x)
+        max_height = std::max(max_height, height[x]);
+    std::vector<size_t> level_begin(max_height + 2, 0), by_height(order);
+    for (size_t x = 0; x < order; ++x)
+        level_begin[height[x] + 1]++;
+    for (size_t h = 0; h <= max_height; ++h)
+        level_begin[h + 1] += level_begin[h];
+    fill.assign(level_begin.begin(), level_begin.end() - 1);
+    for (size_t x = 0; x < order; ++x)
+        by_height[fill[height[x]]++] = x;
+
+    // ids of the trees, a constant c_i is -(i+1) in the key of its element
+    std::vector<std::vector<int>> keys(order);
+    for (size_t idx = 0; idx < constants.size(); ++idx)
+        keys[constants[idx]].push_back(-int(idx) - 1);
+    std::vector<int> id(order, 0);
+    int next_id = 0;
+    for (size_t h = 0; h <= max_height; ++h) {
+        const auto begin = by_height.begin() + level_begin[h], end = by_height.begin() + level_begin[h + 1];
+        for (auto it = begin; it != end; ++it) {
+            std::vector<int>& key = keys[*it];
+            const size_t num_marks = key.size();
+            for (size_t idx = child_begin[*it]; idx < child_begin[*it + 1]; ++idx)
+                key.push_back(id[children[idx]]);
+            std::sort(key.begin() + num_marks, key.end());
+        }
+        std::sort(begin, end, [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+        for (auto it = begin; it != end; ++it) {
+            if (it != begin && keys[*it] != keys[*(it - 1)])
+                ++next_id;
+            id[*it] = next_id;
+        }
+        ++next_id;
+    }
+
+    // the cycles from their least rotation, sorted
+    std::vector<std::pair<std::vector<int>, std::vector<size_t>>> cycles;   // root ids, elements
+    std::vector<bool> seen(order, false);
+    for (size_t x = 0; x < order; ++x) {
+        if (!on_cycle[x] || seen[x])
+            continue;
+        std::vector<size_t> elems;
+        for (size_t y = x; !seen[y]; y = f(y)) {
+            seen[y] = true;
+            elems.push_back(y);
+        }
+        std::vector<int> ids(elems.size());
+        for (size_t idx = 0; idx < elems.size(); ++idx)
+            ids[idx] = id[elems[idx]];
+        const size_t start = least_rotation(ids);
+        std::rotate(ids.begin(), ids.begin() + start, ids.end());
+        std::rotate(elems.begin(), elems.begin() + start, elems.end());
+        cycles.emplace_back(std::move(ids), std::move(elems));
+    }
+    std::sort(cycles.begin(), cycles.end(),
+              [](const std::pair<std::vector<int>, std::vector<size_t>>& a,
+                 const std::pair<std::vector<int>, std::vector<size_t>>& b) { return a.first < b.first; });
+
+    // new labels: each cycle, then its trees breadth first
+    for (size_t y = 0; y < order; ++y) {
+        std::sort(children.begin() + child_begin[y], children.begin() + child_begin[y + 1],
+                  [&id](size_t a, size_t b) { return id[a] < id[b]; });
+    }
+    iso.clear();
+    iso.reserve(order);
+    for (const auto& cycle : cycles) {
+        const size_t first = iso.size();
+        iso.insert(iso.end(), cycle.second.begin(), cycle.second.end());
+        for (size_t idx = first; idx < iso.size(); ++idx) {
+            const size_t y = iso[idx];
+            iso.insert(iso.end(), children.begin() + child_begin[y], children.begin() + child_begin[y + 1]);
+        }
+    }
+}
+
+bool
+Model::canonize_unary_refined()
+{
+    /* Several unary ops: colour refinement of the elements, starting from the constants equal
+       to them; each round sorts the elements by their colour, the colours of their images and
+       the sorted colours of their preimages under each op, and numbers the distinct ones.
+       The colours do not depend on the labelling, so when they end up all distinct, the
+       elements in colour order are a canonical labelling.  Returns false if they do not.
+     */
+    const size_t num_ops = un_ops.size();
+    std::vector<std::vector<size_t>> sigs(order);
+    std::vector<size_t> elems(order), color(order, 0);
+    for (size_t x = 0; x < order; ++x)
+        elems[x] = x;
+    for (size_t idx = 0; idx < constants.size(); ++idx)
+        sigs[constants[idx]].push_back(idx + 1);
+
+    // preimages of each element under op k at [pre_begin[k*order+y], pre_begin[k*order+y+1])
+    std::vector<size_t> pre_begin(num_ops * order + 1, 0), pre(num_ops * order);
+    for (size_t k = 0; k < num_ops; ++k) {
+        for (size_t x = 0; x < order; ++x)
+            pre_begin[k * order + tables.cell(un_ops[k] + x) + 1]++;
+    }
+    for (size_t idx = 0; idx < num_ops * order; ++idx)
+        pre_begin[idx + 1] += pre_begin[idx];
+    std::vector<size_t> fill(pre_begin.begin(), pre_begin.end() - 1);
+    for (size_t k = 0; k < num_ops; ++k) {
+        for (size_t x = 0; x < order; ++x)
+            pre[fill[k * order + tables.cell(un_ops[k] + x)]++] = x;
+    }
+
+    size_t num_colors = 0;
+    for (;;) {
+        std::sort(elems.begin(), elems.end(), [&sigs](size_t a, size_t b) { return sigs[a] < sigs[b]; });
+        size_t colors = 0;
+        for (size_t pos = 0; pos < order; ++pos) {
+            if (pos > 0 && sigs[elems[pos]] != sigs[elems[pos - 1]])
+                ++colors;
+            color[elems[pos]] = colors;
+        }
+        ++colors;
+        if (colors == order)
+            break;
+        if (colors == num_colors)
+            return false;
+        num_colors = colors;
+
+        std::vector<size_t> pre_colors;
+        for (size_t x = 0; x < order; ++x) {
+            std::vector<size_t>& sig = sigs[x];
+            sig.assign(1, color[x]);
+            for (size_t k = 0; k < num_ops; ++k)
+                sig.push_back(color[tables.cell(un_ops[k] + x)]);
+            for (size_t k = 0; k < num_ops; ++k) {
+                pre_colors.clear();
+                for (size_t idx = pre_begin[k * order + x]; idx < pre_begin[k * order + x + 1]; ++idx)
+                    pre_colors.push_back(color[pre[idx]]);
+                std::sort(pre_colors.begin(), pre_colors.end());
+                sig.push_back(pre_colors.size());
+                sig.insert(sig.end(), pre_colors.begin(), pre_colors.end());
+            }
+        }
+    }
+    iso = elems;
+    return true;
+}
+
+void
+Model::refine_cells(int* lab, int* ptn, const int E_e, const int R_v, const int F_a, const int S_a,
+                    const int T_a, bool has_S) const
+{
+    /* Splits the E, R, F, S and T cells of the colouring made by color_vertices by the element
+       invariants.  The elements are ordered by invariant, so the order of the new cells
+       does not depend on the labelling and the canonical forms stay comparable between
+       models; they differ from those of the unrefined colouring, though.
+     */
+    std::vector<uint64_t> inv;
+    element_invariants(inv);
+    std::vector<int> elems(order);
+    for (size_t x = 0; x < order; ++x)
+        elems[x] = x;
+    std::sort(elems.begin(), elems.end(), [&inv](int a, int b) { return inv[a] < inv[b] || (inv[a] == inv[b] && a < b); });
+
+    std::vector<int> segments {E_e, F_a};
+    if (bin_ops.size() + un_ops.size() + ternary_ops.size() > 0)   // as in color_vertices
+        segments.push_back(R_v);
+    if (has_S)
+        segments.push_back(S_a);
+    if (!ternary_ops.empty())
+        segments.push_back(T_a);
+    for (int seg : segments) {
+        for (size_t idx = 0; idx < order; ++idx) {
+            lab[seg + idx] = seg + elems[idx];
+            ptn[seg + idx] = idx + 1 < order && inv[elems[idx]] == inv[elems[idx + 1]] ? 1 : 0;
+        }
+    }
+}
+
+uint64_t
+Model::invariant_hash(bool up_to_transpose)
+{
+    /* A hash of properties that do not depend on the labelling of the elements, so
+       isomorphic models have the same invariant hash.  Cheap compared to build_graph:
+       per table, the sorted histogram of the values, the sorted profile of the rows and of
+       the columns (number of distinct values for an op, number of true cells for a relation),
+       and for ops the number of fixed points or idempotents, the sorted histogram of the
+       diagonal and the number of commuting pairs.  For a ternary op, the sorted histogram of
+       the values and the number of idempotents.
+       With up_to_transpose the row and column profiles are taken in sorted order, so a model
+       and its transpose have the same hash as well.
+     */
+    num_unassigned = count_unassigned();
+    std::vector<uint64_t> inv {key_header()};
+    std::vector<size_t>   counts, rows, cols;
+    auto add_sorted = [&inv](std::vector<size_t>& v) {
+        std::sort(v.begin(), v.end());
+        inv.insert(inv.end(), v.begin(), v.end());
+    };
+
+    for (auto op : un_ops) {
+        counts.assign(order, 0);
+        tables.add_counts(op, op + order, counts);
+        size_t fixed = 0;
+        for (size_t x = 0; x < order; ++x)
+            fixed += tables.cell(op + x) == int(x);
+        inv.push_back(fixed);
+        add_sorted(counts);
+    }
+    for (size_t kind = 0; kind < 2; ++kind) {
+        const bool is_func = kind == 0;
+        const std::vector<size_t>& tabs = is_func? bin_ops : bin_rels;
+        for (auto op : tabs) {
+            counts.assign(is_func? order : 2, 0);
+            tables.add_counts(op, op + order * order, counts);
+            if (is_func)
+                add_sorted(counts);
+            else   // the truth values are not relabelled
+                inv.insert(inv.end(), counts.begin(), counts.end());
+            rows.assign(order, 0);
+            cols.assign(order, 0);
+            std::vector<bool> seen(order);
+            for (size_t x = 0; x < order; ++x) {
+                std::fill(seen.begin(), seen.end(), false);
+                for (size_t y = 0; y < order; ++y) {
+                    int v = tables.cell(op + x * order + y);
+                    if (!is_func)
+                        rows[x] += v == 1;
+                    else if (v >= 0 && !seen[v]) {
+                        seen[v] = true;
+                        rows[x]++;
+                    }
+                }
+                std::fill(seen.begin(), seen.end(), false);
+                for (size_t y = 0; y < order; ++y) {
+                    int v = tables.cell(op + y * order + x);
+                    if (!is_func)
+                        cols[x] += v == 1;
+                    else if (v >= 0 && !seen[v]) {
+                        seen[v] = true;
+                        cols[x]++;
+                    }
+                }
+            }
+            std::sort(rows.begin(), rows.end());
+            std::sort(cols.begin(), cols.end());
+            if (up_to_transpose && cols < rows)
+                rows.swap(cols);
+            inv.insert(inv.end(), rows.begin(), rows.end());
+            inv.insert(inv.end(), cols.begin(), cols.end());
+            size_t idempotents = 0, commuting = 0;
+            counts.assign(is_func? order + 1 : 3, 0);
+            for (size_t x = 0; x < order; ++x) {
+                int d = tables.cell(op + x * order + x);
+                idempotents += d == int(x);
+                counts[d + 1]++;
+                for (size_t y = x + 1; y < order; ++y)
+                    commuting += tables.cell(op + x * order + y) == tables.cell(op + y * order + x);
+            }
+            if (is_func) {   // for a relation, the diagonal counts are the idempotents
+                inv.push_back(idempotents);
+                add_sorted(counts);
+            }
+            else
+                inv.insert(inv.end(), counts.begin(), counts.end());
+            inv.push_back(commuting);
+        }
+    }
+    for (auto op : ternary_ops) {
+        counts.assign(order, 0);
+        tables.add_counts(op, op + order * order * order, counts);
+        size_t idempotents = 0;
+        for (size_t x = 0; x < order; ++x)
+            idempotents += tables.cell(op + (x * order + x) * order + x) == int(x);
+        inv.push_back(idempotents);
+        add_sorted(counts);
+    }
+    // properties of the elements named by the constants
+    for (auto cst : constants) {
+        uint64_t props = 0;
+        if (cst >= 0) {
+            for (auto op : un_ops)
+                props = props * 2 + (tables.cell(op + cst) == cst);
+            for (auto op : bin_ops)
+                props = props * 2 + (tables.cell(op + cst * order + cst) == cst);
+        }
+        inv.push_back(props);
+    }
+    return CanonKey::hash_words(inv.data(), inv.size());
+}
+
+void
+Model::canonical_key(CanonKey& key) const
+{
+    /* Same cells in the same order as compress_cms, relabelled by the canonical labelling,
+       but each cell packed in the fewest bits that hold all the values of its table.
+       If the model has unassigned cells, the values are shifted up by one and 0 is unassigned.
+     */
+    std::vector<size_t> inv(order, 0);
+    // find inverse of the isomorphism that maps the vectors to canonical form
+    for (size_t v = 0; v < order; ++v) 
+        inv[iso[v]] = v;
+
+    const int      shift = num_unassigned > 0? 1 : 0;
+    const unsigned width = CanonKey::bits_for(order + shift);
+    const unsigned rel_width = CanonKey::bits_for(2 + shift);
+
+    key.reset(key_header());
+    for (auto to : ternary_ops) {
+        for (size_t a = 0; a < order; ++a) {
+            for (size_t b = 0; b < order; ++b) {
+                const size_t row = to + (iso[a] * order + iso[b]) * order;
+                for (size_t c = 0; c < order; ++c)
+                    key.push(get_cell_value(inv, tables.cell(row + iso[c])) + shift, width);
+            }
+        }
+    }
+    const size_t row_step = transposed? 1 : order;   // cell (r, c) of the transpose is (c, r)
+    const size_t col_step = transposed? order : 1;
+    for (auto bo : bin_ops) {
+        for (size_t r = 0; r < order; ++r) {
+            const size_t row = bo + iso[r] * row_step;
+            for (size_t c = 0; c < order; ++c)
+                key.push(get_cell_value(inv, tables.cell(row + iso[c] * col_step)) + shift, width);
+        }
+    }
+    for (auto bo : bin_rels) {
+        for (size_t r = 0; r < order; ++r) {
+            const size_t row = bo + iso[r] * row_step;
+            for (size_t c = 0; c < order; ++c)
+                key.push(tables.cell(row + iso[c] * col_step) + shift, rel_width);
+        }
+    }
+    for (auto uo : un_ops) {
+        for (size_t r = 0; r < order; ++r )
+            key.push(get_cell_value(inv, tables.cell(uo + iso[r])) + shift, width);
+    }
+    for (auto cst : constants)
+        key.push(get_cell_value(inv, cst) + shift, width);
+    key.finish();
+}
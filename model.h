@@ -14,8 +14,11 @@
 #include <iostream>
 #include <fstream>
 
+#include "op_tables.h"
 
 struct sparsegraph;
+class  CanonWorkspace;
+class  CanonKey;
 
 class Model {
 public:
@@ -25,15 +28,17 @@ public:
     static const std::string Function_arity_label;
     static const std::string Function_unary_label;
     static const std::string Function_binary_label;
+    static const std::string Function_ternary_label;
     static const std::string Function_stopper;
     static const std::string Model_stopper;
 
 public:
-    std::vector<std::vector<std::vector<std::vector<int>>>> ternary_ops;
-    std::vector<std::vector<std::vector<int>>> bin_ops;
-    std::vector<std::vector<std::vector<int>>> bin_rels;
-    std::vector<std::vector<int>> un_ops;
-    std::vector<int> constants;
+    OpTables            tables;        // cells of all the op/rel tables below
+    std::vector<size_t> ternary_ops;   // position of each table in "tables"
+    std::vector<size_t> bin_ops;
+    std::vector<size_t> bin_rels;
+    std::vector<size_t> un_ops;
+    std::vector<int>    constants;
     size_t num_unassigned;
 
     std::vector<std::string>  op_symbols;
@@ -42,14 +47,18 @@ public:
     size_t       el_fixed_width;
     sparsegraph* cg;
     std::string  model_str;
+    const char*  text_begin;   // model text in the input buffer when parsed in place, model_str is empty then
+    size_t       text_len;
     std::vector<std::size_t>  iso;
     bool   save_cg;
+    bool   transposed;   // iso labels the transpose: the binary tables with their arguments swapped
 
 private:
     static const char Base64Table[];
     static const char unassigned = '?';
     static const char padding = '=';
     static const char op_end = ';';
+    static const size_t Intercalate_max_order = 64;   // above, vertex_invariants skips the O(n^4) count
 
 private:
     void   set_width(size_t order);
@@ -57,28 +66,54 @@ private:
     void   compress_small_str(bool is_even, int val, std::string& cms) const;
     size_t find_graph_size(size_t& num_vertices, size_t& num_edges);
     void   color_vertices(int* ptn, int* lab, int ptn_sz);
+    void   element_invariants(std::vector<uint64_t>& inv) const;
+    void   vertex_invariants(std::vector<int>& vinv, size_t num_vertices, const int E_e, const int R_v,
+                             const int F_a, const int S_a, const int A_c, bool has_S) const;
+    void   direct_code(const std::vector<int>& label, const std::vector<size_t>& elems, size_t depth,
+                       std::vector<uint32_t>& code) const;
+    struct DirectSearch;
+    bool   is_swap_automorphism(size_t x, size_t y) const;
+    void   direct_search(DirectSearch& ds, size_t depth);
+    size_t canonize_direct();
+    bool   canonize_unary();
+    void   canonize_functional();
+    bool   canonize_unary_refined();
+    void   refine_cells(int* lab, int* ptn, const int E_e, const int R_v, const int F_a, const int S_a,
+                        const int T_a, bool has_S) const;
     void   count_occurrences(std::vector<size_t>& R_v_count);
     void   count_truth_values(std::vector<size_t>& L_v_count);
     size_t count_unassigned();
     size_t count_unassigned_rels();
-    void   build_vertices(sparsegraph& sg1, const int E_e, const int F_a, const int S_a, 
-                          const int R_v, const int L_v, const int U_v, const int A_c);
-    void   build_edges(sparsegraph& sg1, const int E_e, const int F_a, const int S_a, 
-                       const int R_v, const int L_v, const int U_v, const int A_c);
+    void   build_vertices(sparsegraph& sg1, const int E_e, const int F_a, const int S_a, const int T_a,
+                          const int A_c);
+    void   build_edges(sparsegraph& sg1, const int E_e, const int F_a, const int S_a, const int T_a,
+                       const int R_v, const int A_c);
+    void   build_results(sparsegraph& sg1, const int E_e, const int R_v, const int L_v, const int U_v, const int A_c);
+    bool   build_relation_graph(CanonWorkspace& ws, bool save_cg);
+    bool   canonize(CanonWorkspace& ws, bool save_cg);
+    void   link_result(sparsegraph& sg1, const int A_c_el, const size_t epos, const int V_v, const int U_v, int cval);
 
     void   debug_print_edges(sparsegraph& sg1, const int E_e, const int F_a, const int S_a, 
                              const int R_v, const int A_c, bool has_S);
 
     bool parse_unary(const std::string& line, bool ignore_op);
-    bool parse_bin(std::istream& f, bool is_func, bool ignore_op);
+    bool parse_bin(std::istream& f, bool is_func, size_t arity, bool ignore_op);
     void parse_row(std::string& line, std::vector<int>& row);
     int  find_arity(const std::string& func);
+    bool parse_unary(const char* line, const char* eol, bool ignore_op);
+    bool parse_bin(const char*& pos, const char* end, bool is_func, size_t arity, bool ignore_op);
+    void parse_row(const char* p, const char* e, size_t& pos, size_t table_end);
+    void store_row(const std::vector<int>& row, size_t& pos, size_t table_end);
+    int  find_arity(const char* line, const char* eol);
+    bool is_checked_sym(const char* line, const char* eol, const std::string& check_sym);
     void blankout(std::string& s) { std::replace( s.begin(), s.end(), ']', ' '); std::replace( s.begin(), s.end(), ',', ' '); };
     static int  get_cell_value(const std::vector<size_t>& inv, int val);
     void remove_unassigned(std::string&) const;
+    uint64_t key_header() const;
 
 public:
-    Model(): order(2), el_fixed_width(1), cg(nullptr), num_unassigned(0), save_cg(false) {};
+    Model(): num_unassigned(0), order(2), el_fixed_width(1), cg(nullptr), text_begin(nullptr), text_len(0), save_cg(false),
+             transposed(false) {};
     Model(size_t odr, std::vector<int>& constants, std::vector<std::vector<int>>& un_ops,
           std::vector<std::vector<std::vector<int>>>& bin_ops, std::vector<std::vector<std::vector<int>>>& bin_rels,
           bool save_cg = false);
@@ -90,13 +125,20 @@ public:
     std::string  cg_to_string(const char* sep = "\n", bool shorten = false) { return graph_to_string(cg, sep); };
 
     void print_model(std::ostream&, const std::string& canon_str, bool out_cg=false) const;
+    void print_text(std::ostream&) const;
 
     void fill_meta_data(const std::string& interp);
+    void fill_meta_data(const char* line, const char* eol);
     std::string find_func_name(const std::string& func);
 
     bool parse_model(std::istream& f, const std::string& check_sym);
+    bool parse_model(const char*& pos, const char* end, const std::string& check_sym);
     bool build_graph(bool save_cg = false);
+    bool build_graph(CanonWorkspace& ws, bool save_cg = false);
     std::string compress_cms() const;
+    void canonical_key(CanonKey& key) const;
+    void raw_tables(std::string& raw) const;
+    uint64_t invariant_hash(bool up_to_transpose = false);
 };
 
 #endif
@@ -0,0 +1,84 @@
+/* op_tables.h : flat storage for the operation and relation tables of a model. */
+/* Version 1.1, July 2023. */
+
+#ifndef OP_TABLES_H
+#define OP_TABLES_H
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*  All the tables of one model are kept in one buffer.  A table is identified by the
+    position of its first cell, and its cells are stored row-major: cell (a, b) of a
+    binary table at pos is at pos + a*order + b.
+    Cells take one byte for orders up to 255 and two bytes above that.  The largest
+    value of the cell type stands for an unassigned cell, which reads back as -1.
+ */
+class OpTables {
+private:
+    std::vector<uint8_t>  cells8;
+    std::vector<uint16_t> cells16;
+    bool                  wide;
+
+public:
+    OpTables() : wide(false) {};
+
+    void   reset(size_t order) { cells8.clear(); cells16.clear(); wide = order > UINT8_MAX; };
+    size_t size() const { return wide? cells16.size() : cells8.size(); };
+
+    // appends a table of num_cells unassigned cells, returns its position
+    size_t add_table(size_t num_cells) {
+        size_t pos = size();
+        if (wide)
+            cells16.resize(pos + num_cells, UINT16_MAX);
+        else
+            cells8.resize(pos + num_cells, UINT8_MAX);
+        return pos;
+    };
+
+    int cell(size_t pos) const {
+        if (wide)
+            return cells16[pos] == UINT16_MAX? -1 : cells16[pos];
+        return cells8[pos] == UINT8_MAX? -1 : cells8[pos];
+    };
+
+    void set_cell(size_t pos, int val) {
+        if (wide)
+            cells16[pos] = val < 0? UINT16_MAX : val;
+        else
+            cells8[pos] = val < 0? UINT8_MAX : val;
+    };
+
+    // number of cells in [begin, end) holding val (-1 for unassigned)
+    size_t count(size_t begin, size_t end, int val) const {
+        if (wide)
+            return std::count(cells16.begin() + begin, cells16.begin() + end, val < 0? UINT16_MAX : val);
+        return std::count(cells8.begin() + begin, cells8.begin() + end, val < 0? UINT8_MAX : val);
+    };
+
+    // appends the bytes of all the cells to raw
+    void append_raw(std::string& raw) const {
+        if (wide)
+            raw.append(reinterpret_cast<const char*>(cells16.data()), cells16.size() * sizeof(uint16_t));
+        else
+            raw.append(reinterpret_cast<const char*>(cells8.data()), cells8.size());
+    };
+
+    // counts[v]++ for each assigned cell in [begin, end) holding v
+    void add_counts(size_t begin, size_t end, std::vector<size_t>& counts) const {
+        if (wide) {
+            for (size_t pos = begin; pos < end; ++pos)
+                if (cells16[pos] != UINT16_MAX)
+                    counts[cells16[pos]]++;
+        }
+        else {
+            for (size_t pos = begin; pos < end; ++pos)
+                if (cells8[pos] != UINT8_MAX)
+                    counts[cells8[pos]]++;
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,38 @@
+/* repeat_cache.cpp
+ */
+#include <functional>
+#include "repeat_cache.h"
+
+void
+RepeatCache::erase(std::list<Entry>::iterator it)
+{
+    num_bytes -= entry_bytes(it->raw);
+    by_hash.erase(it->hash);
+    lru.erase(it);
+}
+
+bool
+RepeatCache::seen(const std::string& raw)
+{
+    /* A hit moves the entry to the front.  A miss adds raw at the front, replacing the entry
+       with the same hash if there is one, and evicts from the back down to max_bytes.
+     */
+    const uint64_t h = std::hash<std::string>()(raw);
+    auto found = by_hash.find(h);
+    if (found != by_hash.end()) {
+        if (found->second->raw == raw) {
+            lru.splice(lru.begin(), lru, found->second);
+            num_hits++;
+            return true;
+        }
+        erase(found->second);
+    }
+    lru.push_front(Entry{h, raw});
+    by_hash[h] = lru.begin();
+    num_bytes += entry_bytes(raw);
+    while (num_bytes > max_bytes && lru.size() > 1) {
+        erase(std::prev(lru.end()));
+        num_evicted++;
+    }
+    return false;
+}
@@ -0,0 +1,48 @@
+/* repeat_cache.h : bounded LRU cache of raw model tables, to skip exact repeats. */
+/* Version 1.1, July 2023. */
+
+#ifndef REPEAT_CACHE_H
+#define REPEAT_CACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+/*  The tables of the recently seen models, as parsed and before any relabelling (see
+    Model::raw_tables).  A model whose tables are in the cache is an exact repeat of an
+    earlier one and needs no canonicalization.  The entries are found by a hash of the
+    tables and compared in full, so a repeat is never a false positive.  Once the entries
+    take more than max_bytes, the least recently seen ones are evicted.
+ */
+class RepeatCache {
+private:
+    struct Entry {
+        uint64_t    hash;
+        std::string raw;
+    };
+    std::list<Entry>                                           lru;       // most recently seen first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator>   by_hash;   // one entry per hash
+    size_t max_bytes;
+    size_t num_bytes;
+    size_t num_hits;
+    size_t num_evicted;
+
+private:
+    static size_t entry_bytes(const std::string& raw) { return raw.size() + sizeof(Entry) + 4 * sizeof(void*); };
+    void   erase(std::list<Entry>::iterator it);
+
+public:
+    RepeatCache() : max_bytes(0), num_bytes(0), num_hits(0), num_evicted(0) {};
+
+    void   set_capacity(size_t bytes) { max_bytes = bytes; };
+    bool   is_enabled() const { return max_bytes > 0; };
+    bool   seen(const std::string& raw);    // true if raw is in the cache, else it is added
+
+    size_t size() const { return lru.size(); };
+    size_t hits() const { return num_hits; };
+    size_t evicted() const { return num_evicted; };
+};
+
+#endif
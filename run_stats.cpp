@@ -0,0 +1,128 @@
+/* run_stats.cpp
+ */
+#include <cmath>
+#include <algorithm>
+#include "run_stats.h"
+
+const char* const RunStats::Phase_names[RunStats::Num_phases] = {
+    "parse", "graph", "nauty", "key", "lookup", "output"
+};
+
+void
+RunStats::Histogram::add(double val)
+{
+    size_t b = val < 0? 0 : size_t(val);
+    if (log_scale)
+        b = val < 1? 0 : size_t(std::log2(val)) + 1;
+    if (b >= buckets.size())
+        buckets.resize(b + 1, 0);
+    buckets[b]++;
+    count++;
+    sum += val;
+    if (val > max)
+        max = val;
+}
+
+void
+RunStats::Histogram::merge(const Histogram& h)
+{
+    if (h.buckets.size() > buckets.size())
+        buckets.resize(h.buckets.size(), 0);
+    for (size_t b = 0; b < h.buckets.size(); ++b)
+        buckets[b] += h.buckets[b];
+    count += h.count;
+    sum += h.sum;
+    if (h.max > max)
+        max = h.max;
+}
+
+double
+RunStats::Histogram::percentile(double p) const
+{
+    const double rank = p / 100 * count;
+    size_t below = 0;
+    for (size_t b = 0; b < buckets.size(); ++b) {
+        below += buckets[b];
+        if (below >= rank && below > 0)
+            return std::min(upper(b), max);
+    }
+    return max;
+}
+
+void
+RunStats::Histogram::print_json(std::ostream& out) const
+{
+    out << "{\"count\": " << count << ", \"mean\": " << (count > 0? sum / count : 0) << ", \"max\": " << max
+        << ", \"p50\": " << percentile(50) << ", \"p90\": " << percentile(90) << ", \"p99\": " << percentile(99)
+        << ", \"p999\": " << percentile(99.9) << ", \"buckets\": [";
+    const char* sep = "";
+    for (size_t b = 0; b < buckets.size(); ++b) {
+        if (buckets[b] == 0)
+            continue;
+        out << sep << "[" << lower(b) << ", " << buckets[b] << "]";
+        sep = ", ";
+    }
+    out << "]}";
+}
+
+RunStats::RunStats()
+    : nested(0), numnodes(true), numbadleaves(true), maxlevel(false), log2_grpsize(false)
+{
+    std::fill(phase_cycles, phase_cycles + Num_phases, 0);
+    std::fill(phase_calls, phase_calls + Num_phases, 0);
+}
+
+void
+RunStats::add_search(uint64_t search_cycles, const statsblk& stats)
+{
+    // the search is also inside the enclosing phase, which lap() then takes it off
+    phase_cycles[Nauty_phase] += search_cycles;
+    phase_calls[Nauty_phase]++;
+    nested += search_cycles;
+    numnodes.add(stats.numnodes);
+    numbadleaves.add(stats.numbadleaves);
+    maxlevel.add(stats.maxlevel);
+    // grpsize1 * 10^grpsize2 can be far beyond a double, its log is not
+    log2_grpsize.add(std::round(std::log2(stats.grpsize1) + stats.grpsize2 * std::log2(10.0)));
+}
+
+void
+RunStats::merge(const RunStats& rs)
+{
+    for (int p = 0; p < Num_phases; ++p) {
+        phase_cycles[p] += rs.phase_cycles[p];
+        phase_calls[p] += rs.phase_calls[p];
+    }
+    numnodes.merge(rs.numnodes);
+    numbadleaves.merge(rs.numbadleaves);
+    maxlevel.merge(rs.maxlevel);
+    log2_grpsize.merge(rs.log2_grpsize);
+}
+
+void
+RunStats::print_json(std::ostream& out, size_t num_models, double cycles_per_second) const
+{
+    /* One JSON object: the models read, the clock rate, then for each phase the calls,
+       cycles and estimated seconds, and the histograms of the nauty searches.
+     */
+    uint64_t total = 0;
+    for (int p = 0; p < Num_phases; ++p)
+        total += phase_cycles[p];
+    out << "{\n  \"models\": " << num_models << ",\n  \"cycles_per_second\": " << cycles_per_second
+        << ",\n  \"phases\": {";
+    for (int p = 0; p < Num_phases; ++p) {
+        out << (p > 0? ",\n" : "\n") << "    \"" << Phase_names[p] << "\": {\"calls\": " << phase_calls[p]
+            << ", \"cycles\": " << phase_cycles[p]
+            << ", \"seconds\": " << (cycles_per_second > 0? phase_cycles[p] / cycles_per_second : 0)
+            << ", \"share\": " << (total > 0? double(phase_cycles[p]) / total : 0) << "}";
+    }
+    out << "\n  },\n  \"nauty\": {\n    \"numnodes\": ";
+    numnodes.print_json(out);
+    out << ",\n    \"numbadleaves\": ";
+    numbadleaves.print_json(out);
+    out << ",\n    \"maxlevel\": ";
+    maxlevel.print_json(out);
+    out << ",\n    \"log2_grpsize\": ";
+    log2_grpsize.print_json(out);
+    out << "\n  }\n}" << std::endl;
+}
@@ -0,0 +1,114 @@
+/* run_stats.h : per-phase cycle counts and nauty search statistics, for --stats. */
+/* Version 1.1, July 2023. */
+
+#ifndef RUN_STATS_H
+#define RUN_STATS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "nauty.h"
+
+// the canonizer calls made for one model (two with --anti-iso), see HardestModels
+struct SearchCost {
+    uint64_t cycles;
+    double   numnodes;
+    size_t   calls;
+    size_t   direct_calls;   // labellings without nauty (direct search, unary models)
+    int      maxlevel;
+    double   grpsize1;    // group size of the last call, grpsize1 * 10^grpsize2
+    int      grpsize2;
+
+    SearchCost() : cycles(0), numnodes(0), calls(0), direct_calls(0), maxlevel(0), grpsize1(1), grpsize2(0) {};
+
+    void add(uint64_t search_cycles, const statsblk& stats) {
+        cycles += search_cycles;
+        numnodes += stats.numnodes;
+        calls++;
+        maxlevel = std::max(maxlevel, stats.maxlevel);
+        grpsize1 = stats.grpsize1;
+        grpsize2 = stats.grpsize2;
+    };
+    // a labelling by Model::canonize_direct (its search nodes) or the functional canonizer (none)
+    void add_direct(uint64_t search_cycles, double nodes) {
+        cycles += search_cycles;
+        numnodes += nodes;
+        direct_calls++;
+    };
+};
+
+/*  Counters of one thread: the cycles spent in each phase of the canonicalization of the
+    models, and histograms of the statistics of the nauty searches.  Each worker thread
+    keeps its own (in its CanonWorkspace) and they are merged at the end, so the phase
+    cycles are summed over the threads.
+ */
+class RunStats {
+public:
+    enum Phase { Parse_phase, Graph_phase, Nauty_phase, Key_phase, Lookup_phase, Output_phase, Num_phases };
+    static const char* const Phase_names[Num_phases];
+
+    // Counts per value, in buckets [2^(b-1), 2^b) with log_scale, of one value otherwise.
+    class Histogram {
+    private:
+        bool                log_scale;
+        std::vector<size_t> buckets;
+        size_t              count;
+        double              sum;
+        double              max;
+
+    private:
+        double lower(size_t b) const { return !log_scale || b == 0? b : double(uint64_t(1) << (b - 1)); };
+        double upper(size_t b) const { return !log_scale || b == 0? b : double(uint64_t(1) << b) - 1; };
+
+    public:
+        Histogram(bool log_scale) : log_scale(log_scale), count(0), sum(0), max(0) {};
+
+        void   add(double val);
+        void   merge(const Histogram& h);
+        double percentile(double p) const;    // upper end of the bucket, at most max
+        void   print_json(std::ostream& out) const;
+    };
+
+private:
+    uint64_t  phase_cycles[Num_phases];
+    size_t    phase_calls[Num_phases];
+    uint64_t  nested;       // cycles of nauty calls not yet taken off the enclosing phase
+    Histogram numnodes;
+    Histogram numbadleaves;
+    Histogram maxlevel;
+    Histogram log2_grpsize;
+
+public:
+    RunStats();
+
+    // time stamp counter, or nanoseconds where there is none
+    static uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    };
+
+    // adds the cycles since start, but those of nauty calls in between, to phase; start is reset
+    void lap(Phase phase, uint64_t& start) {
+        const uint64_t now = cycles();
+        phase_cycles[phase] += now - start - nested;
+        phase_calls[phase]++;
+        nested = 0;
+        start = now;
+    };
+    void add_search(uint64_t search_cycles, const statsblk& stats);
+    void merge(const RunStats& rs);
+    void print_json(std::ostream& out, size_t num_models, double cycles_per_second) const;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#!/bin/sh
+# check_counts.sh : number of classes isonaut prints for the fixtures of counts.txt, in one mode.
+#
+#   check_counts.sh ISONAUT MODE
+#
+# MODE is one of
+#   default      no options
+#   threads      -j 2, and -j 2 --mmap
+#   mmap         --mmap
+#   lazy         --lazy
+#   fingerprint  --fingerprint, and --fingerprint --verify, which must find no collision
+#   mem-budget   --mem-budget 1 (dedup with sorted runs on disk)
+#   index        --save-index, then --load-index and --query on the same fixture print nothing
+#                (also when the index is saved with -c)
+#   anti-iso     --anti-iso, single-threaded and with -j 2
+#   engines      --engine nauty, dense, traces and direct
+#   repeat       the fixture twice in a row, with and without the exact-repeat cache
+#   refine       --refine, alone and with --engine nauty
+#   invariant    --invariant isonaut and distances, and --maxinvarlevel 1 (with --engine nauty, and
+#                isonaut with auto too)
+#   stats        --stats, single-threaded and with -j 2: the counts, and the JSON has "models" equal
+#                to the number of models of the fixture (and parses, if python3 is found)
+# A fixture not in tests/ is made by make_fixture.
+
+isonaut=$1
+mode=$2
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/isonaut_check.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+# classes printed by isonaut with the options given, the file last
+classes() {
+    "$isonaut" "$@" 2>/dev/null | grep -c '^interpretation('
+}
+
+# expect NAME EXPECTED GOT WHAT
+expect() {
+    if [ "$3" != "$2" ]; then
+        echo "FAIL $mode $1 ($4): $3 classes, expected $2"
+        failed=1
+    fi
+}
+
+# make_fixture NAME: the models of a fixture too big to keep in tests/, on stdout
+make_fixture() {
+    case $1 in
+    magma3)   # all the binary operations of order 3
+        awk 'BEGIN {
+            n = 3
+            for (i = 0; i < n ^ (n * n); i++) {
+                printf "interpretation( %d, [number=%d, seconds=0], [\n  function(*(_,_), [\n", n, i + 1
+                x = i
+                for (c = 0; c < n * n; c++) {
+                    printf "%s%d%s", (c % n == 0? "    " : ""), x % n, (c == n * n - 1? " ])]).\n\n" : (c % n == n - 1? ",\n" : ","))
+                    x = int(x / n)
+                }
+            }
+        }' ;;
+    *)
+        return 1 ;;
+    esac
+}
+
+check_fixture() {
+    name=$1; file=$2; n=$3; anti=$4
+    case $mode in
+    default)
+        expect "$name" "$n" "$(classes "$file")" "no options" ;;
+    threads)
+        expect "$name" "$n" "$(classes -j 2 "$file")" "-j 2"
+        expect "$name" "$n" "$(classes -j 2 --mmap "$file")" "-j 2 --mmap" ;;
+    mmap)
+        expect "$name" "$n" "$(classes --mmap "$file")" "--mmap" ;;
+    lazy)
+        expect "$name" "$n" "$(classes --lazy "$file")" "--lazy" ;;
+    fingerprint)
+        expect "$name" "$n" "$(classes --fingerprint "$file")" "--fingerprint"
+        rm -rf "$work/verify"; mkdir "$work/verify"
+        "$isonaut" --fingerprint --verify "$work/verify" "$file" 2>/dev/null > "$work/out"
+        expect "$name" "$n" "$(grep -c '^interpretation(' "$work/out")" "--fingerprint --verify"
+        if ! grep -q '^% Fingerprint collisions found: 0 ' "$work/out"; then
+            echo "FAIL $mode $name: $(grep '^% Fingerprint collisions' "$work/out")"
+            failed=1
+        fi ;;
+    mem-budget)
+        expect "$name" "$n" "$(classes --mem-budget 1 --spill-dir "$work" "$file")" "--mem-budget 1" ;;
+    index)
+        rm -f "$work/index"
+        expect "$name" "$n" "$(classes --save-index "$work/index" "$file")" "--save-index"
+        expect "$name" 0 "$(classes --load-index "$work/index" "$file")" "--load-index"
+        expect "$name" 0 "$(classes --query "$work/index" "$file")" "--query"
+        expect "$name" 0 "$(classes --load-index "$work/index" --save-index "$work/index" "$file")" \
+               "--load-index --save-index"
+        rm -f "$work/index"
+        expect "$name" "$n" "$(classes -c --save-index "$work/index" "$file")" "-c --save-index"
+        expect "$name" 0 "$(classes --query "$work/index" "$file")" "--query after -c --save-index" ;;
+    anti-iso)
+        expect "$name" "$anti" "$(classes --anti-iso "$file")" "--anti-iso"
+        expect "$name" "$anti" "$(classes --anti-iso -j 2 "$file")" "--anti-iso -j 2" ;;
+    engines)
+        for engine in nauty dense traces direct; do
+            expect "$name" "$n" "$(classes --engine $engine "$file")" "--engine $engine"
+        done ;;
+    repeat)
+        cat "$file" "$file" > "$work/twice.txt"
+        expect "$name" "$n" "$(classes "$work/twice.txt")" "twice"
+        expect "$name" "$n" "$(classes --repeat-cache 0 "$work/twice.txt")" "twice, --repeat-cache 0" ;;
+    refine)
+        expect "$name" "$n" "$(classes --refine "$file")" "--refine"
+        expect "$name" "$n" "$(classes --refine --engine nauty "$file")" "--refine --engine nauty" ;;
+    invariant)
+        expect "$name" "$n" "$(classes --invariant isonaut "$file")" "--invariant isonaut"
+        for invariant in isonaut distances; do
+            expect "$name" "$n" "$(classes --engine nauty --invariant $invariant "$file")" \
+                   "--engine nauty --invariant $invariant"
+            expect "$name" "$n" "$(classes --engine nauty --invariant $invariant --maxinvarlevel 1 "$file")" \
+                   "--engine nauty --invariant $invariant --maxinvarlevel 1"
+        done ;;
+    stats)
+        models=$(grep -c '^interpretation(' "$file")
+        for jobs in 1 2; do
+            expect "$name" "$n" "$(classes -j $jobs --stats "$work/stats.json" "$file")" "-j $jobs --stats"
+            got=$(sed -n 's/^ *"models": \([0-9]*\),$/\1/p' "$work/stats.json")
+            if [ "$got" != "$models" ]; then
+                echo "FAIL $mode $name (-j $jobs --stats): \"models\": $got, expected $models"
+                failed=1
+            fi
+            if command -v python3 >/dev/null 2>&1 &&
+               ! python3 -c 'import json, sys; json.load(open(sys.argv[1]))' "$work/stats.json"; then
+                echo "FAIL $mode $name (-j $jobs --stats): the JSON does not parse"
+                failed=1
+            fi
+        done ;;
+    esac
+}
+
+case $mode in
+default|threads|mmap|lazy|fingerprint|mem-budget|index|anti-iso|engines|repeat|refine|invariant|stats) ;;
+*)
+    echo "check_counts.sh: unknown mode $mode"
+    exit 2 ;;
+esac
+
+grep -v '^#' "$here/counts.txt" | while read -r name n anti; do
+    [ -n "$name" ] || continue
+    file=$here/$name.txt
+    if [ ! -f "$file" ]; then
+        file=$work/$name.txt
+        if ! make_fixture "$name" > "$file"; then
+            echo "FAIL $name: no fixture"
+            echo failed > "$work/failed"
+            continue
+        fi
+    fi
+    check_fixture "$name" "$file" "$n" "$anti"
+    [ $failed = 0 ] || echo failed > "$work/failed"
+done
+[ -f "$work/failed" ] && exit 1
+exit 0